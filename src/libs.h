@@ -1,8 +1,13 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_video.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <poll.h>
+#include <regex.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
@@ -13,3 +18,6 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <vterm.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
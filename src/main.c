@@ -6,28 +6,136 @@
 // --- Config ---
 #define FONT_PATH "src/font.ttf"
 #define FONT_SIZE 25.0f
+// Tried in order for codepoints FONT_PATH lacks; missing files are skipped
+// and collections (.ttc) add all their faces. OOLONG_FONTS, a colon-separated
+// list, replaces these at runtime.
+#define FONT_FALLBACKS                                                         \
+  {"/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf",                      \
+   "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",                          \
+   "/usr/share/fonts/opentype/noto/NotoSansCJK-Regular.ttc",                   \
+   "/usr/share/fonts/truetype/noto/NotoSansSymbols2-Regular.ttf"}
+#define MAX_FACES 64
+#define ZOOM_STEP 2.0f // Pixels per Ctrl+= / Ctrl+-
+#define ZOOM_MIN 8.0f
+#define ZOOM_MAX 96.0f
+// With --sdf the atlas holds signed distance fields rasterized once at
+// SDF_SIZE and scaled down to every zoom level; SDF_SIZE is also the largest
+// size --sdf zooms to. SDF_PADDING pixels of falloff surround each glyph;
+// SDF_ON_EDGE is the field value at the outline.
+#define SDF_SIZE 48.0f
+#define SDF_PADDING 4
+#define SDF_ON_EDGE 128
 #define ATLAS_WIDTH 2048
 #define ATLAS_HEIGHT 2048
+#define ATLAS_CACHE_DIR "oolong-t" // Under $XDG_CACHE_HOME or ~/.cache
+#define ATLAS_THREADS 0      // Atlas rebuild workers; 0 means one per CPU
+#define ATLAS_MAX_THREADS 32
+#define ATLAS_UPLOAD_ROWS 128 // Rebuilt atlas rows sent per main loop pass
+#define PTY_RING_SIZE (4 << 20) // Must be a power of two
+// Parsing budget per loop iteration before we go and render. The byte budget
+// starts at INGEST_MIN_BYTES and doubles while output keeps backing up.
+#define INGEST_MIN_BYTES (64 << 10)
+#define INGEST_MAX_BYTES (1 << 20)
+#define INGEST_BUDGET_US 2000
+#define INGEST_SLICE (16 << 10) // Bytes per vterm_input_write between checks
+// Throughput mode drops to THROUGHPUT_FPS while the shell writes faster than
+// THROUGHPUT_RATE bytes/s. Toggled at runtime with Ctrl+Shift+T.
+#define THROUGHPUT_MODE 1
+#define THROUGHPUT_FPS 20
+#define THROUGHPUT_RATE (4 << 20)
+#define CURSOR_BLINK_MS 500
+#define CURSOR_IDLE_MS 10000 // Stop blinking after this long without input
+// Scrollback held in memory is capped by size, not lines. Beyond this the
+// oldest blocks spill to an unlinked file in $TMPDIR, so history is limited
+// only by disk space.
+#define SCROLLBACK_BUDGET (64 << 20)
+#define SCROLL_WHEEL_LINES 3
+#define PASTE_CHUNK (64 << 10) // Pasted bytes queued per loop iteration
 
 // --- Globals ---
-int master_fd;
+int master_fd = -1;
 pid_t child_pid;
 VTerm *vterm;
 VTermScreen *vterm_screen;
 SDL_Window *window;
 SDL_Renderer *renderer;
 SDL_Texture *font_texture;
+SDL_Texture *frame_texture; // Persistent render target holding the grid
+int frame_rows = 0;
+int frame_cols = 0;
 int dirty = 1;
 
+// Per-row damage accumulated from libvterm since the last frame, indexed by
+// frame_texture row (see frame_top)
+unsigned char *dirty_rows = NULL;
+int dirty_rows_len = 0;
+int frame_top = 0; // frame_texture is a ring of rows; this one is on top
+
 int cell_width = 0;
 int cell_height = 0;
 
-// --- Font Data Ranges ---
-stbtt_packedchar ascii_chars[96];      // 32..126 (Standard Text)
-stbtt_packedchar box_chars[128];       // U+2500..U+257F (Borders)
-stbtt_packedchar powerline_chars[128]; // U+E0A0..U+E0FF (Powerline triangles)
-stbtt_packedchar
-    icon_chars[4096]; // U+E5FA..U+F500 (DevIcons, FontAwesome, etc)
+// --- Stats ---
+// Counters for the most recently rendered frame. Printed to stderr after
+// every frame when OOLONG_STATS is set in the environment.
+typedef struct {
+  int rows_checked; // Damaged rows read from libvterm or scrollback
+  int rows_cached;  // ...of which unchanged in the shadow grid, not redrawn
+  int rows_drawn;
+  int bg_rects;
+  int glyphs;
+  int rasterized; // Glyphs added to the atlas
+  Uint64 build_ticks;  // Reading cells and filling the batches
+  Uint64 submit_ticks; // Batch submission, composition and present
+  Uint64 present_gap;  // Ticks since the previous frame was presented
+} FrameStats;
+
+FrameStats frame_stats;
+int show_stats = 0;
+Uint64 total_rows_checked = 0; // Render cache hit rate over the whole run
+Uint64 total_rows_cached = 0;
+
+// --- Font ---
+// faces[0] is FONT_PATH and sets the cell size; the rest are fallbacks in
+// priority order. Font files stay mapped for the whole run.
+stbtt_fontinfo faces[MAX_FACES];
+int face_count = 0;
+unsigned char *ttf_buffer; // FONT_PATH
+size_t ttf_size;
+uint64_t font_key = 0; // Identifies the font files for the atlas cache
+
+// Glyph ids name a glyph in a face: the face in the high bits, the font's
+// own glyph index in the low 16. Face 0's ids are its plain glyph indices.
+#define GLYPH_ID(face, glyph) ((face) << 16 | (glyph))
+#define GLYPH_FACE(id) ((id) >> 16)
+#define GLYPH_INDEX(id) ((id)&0xFFFF)
+
+// Coverage index: which face draws each codepoint, as face + 1 (0: none).
+// Pages of 256 codepoints are allocated only where some face has glyphs, and
+// the whole index is built from the cmaps at startup, so a lookup is two
+// loads and the fonts are never searched while drawing.
+unsigned char *coverage[0x110000 >> 8];
+
+int coverage_face(uint32_t code) {
+  const unsigned char *page = code < 0x110000 ? coverage[code >> 8] : NULL;
+  return page ? page[code & 255] - 1 : -1;
+}
+float font_size = FONT_SIZE;
+float font_scale;
+int baseline = 0; // Pixels from the top of a cell to the baseline
+
+// Cell geometry for one pixel size
+typedef struct {
+  float size, scale;
+  int cell_width, cell_height, baseline;
+} FontMetrics;
+
+// What the atlas is rasterized at: the grid's own metrics, or SDF_SIZE's
+// when sdf_atlas is set and glyphs are scaled to the grid
+FontMetrics atlas_metrics;
+int sdf_atlas = 0; // --sdf
+
+// Coverage for every slot, kept on the CPU so slots can be re-uploaded
+unsigned char *atlas_bitmap;
 
 // --- PTY Setup (Standard) ---
 void spawn_shell() {
@@ -45,258 +153,3978 @@ void spawn_shell() {
     exit(1);
   }
 
-  char *slave_name = ptsname(master_fd);
-  if (!slave_name) {
-    perror("ptsname");
-    exit(1);
+  char *slave_name = ptsname(master_fd);
+  if (!slave_name) {
+    perror("ptsname");
+    exit(1);
+  }
+
+  child_pid = fork();
+  if (child_pid == 0) {
+    setsid();
+    int slave_fd = open(slave_name, O_RDWR);
+    ioctl(slave_fd, TIOCSCTTY, 0);
+    dup2(slave_fd, 0);
+    dup2(slave_fd, 1);
+    dup2(slave_fd, 2);
+    close(master_fd);
+    close(slave_fd);
+
+    setenv("TERM", "xterm-256color", 1);
+    unsetenv("COLUMNS");
+    unsetenv("LINES");
+    execlp("bash", "bash", NULL);
+    exit(1);
+  }
+}
+
+// --- Session Recording ---
+// --record FILE logs every chunk handed to libvterm and every size change,
+// in parse order, so a replay reproduces the session exactly. The file is
+// RECORD_MAGIC followed by records of a RecordHeader and len payload bytes.
+#define RECORD_MAGIC "OOLREC01"
+
+enum { RECORD_DATA, RECORD_RESIZE };
+
+typedef struct {
+  uint32_t type;
+  uint32_t len;
+  uint64_t time_us; // Since the start of the recording
+} RecordHeader;
+
+FILE *record_file;
+Uint64 record_start;
+
+void record_open(const char *path) {
+  record_file = fopen(path, "wb");
+  if (!record_file) {
+    perror(path);
+    exit(1);
+  }
+  fwrite(RECORD_MAGIC, 1, 8, record_file);
+  record_start = SDL_GetPerformanceCounter();
+}
+
+void record_write(uint32_t type, const void *data, uint32_t len) {
+  RecordHeader hdr = {type, len,
+                      (SDL_GetPerformanceCounter() - record_start) * 1000000 /
+                          SDL_GetPerformanceFrequency()};
+  fwrite(&hdr, sizeof(hdr), 1, record_file);
+  fwrite(data, 1, len, record_file);
+}
+
+// Iterates a mapped recording. Copies the next header out (records are
+// packed, so it may be unaligned) and returns its payload, or NULL at the
+// end or on a truncated record; *off starts just past the magic.
+const char *record_next(const char *map, size_t len, size_t *off,
+                        RecordHeader *hdr) {
+  if (*off + sizeof(RecordHeader) > len)
+    return NULL;
+  memcpy(hdr, map + *off, sizeof(RecordHeader));
+  if (*off + sizeof(RecordHeader) + hdr->len > len)
+    return NULL;
+  const char *payload = map + *off + sizeof(RecordHeader);
+  *off += sizeof(RecordHeader) + hdr->len;
+  return payload;
+}
+
+int is_recording(const char *map, size_t len) {
+  return len >= 8 && memcmp(map, RECORD_MAGIC, 8) == 0;
+}
+
+// --- PTY Writer ---
+// Everything for the shell (keys, text input, libvterm's replies) is queued
+// and flushed once per main loop iteration, so a burst of input goes out in
+// one write. The fd is non-blocking: what the PTY does not take stays queued,
+// and the reader thread, told through pty_wake_pipe, wakes us again once the
+// PTY is writable.
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} ByteBuf;
+
+void buf_append(ByteBuf *b, const char *data, size_t len) {
+  if (b->len + len > b->cap) {
+    b->cap = b->cap ? b->cap : 4096;
+    while (b->len + len > b->cap)
+      b->cap *= 2;
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+void buf_printf(ByteBuf *b, const char *fmt, ...) {
+  char tmp[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  buf_append(b, tmp, n < (int)sizeof(tmp) ? n : (int)sizeof(tmp) - 1);
+}
+
+ByteBuf pty_out;
+size_t pty_out_sent = 0;       // Bytes of pty_out already written
+atomic_int pty_out_blocked;    // Waiting for POLLOUT on master_fd
+int pty_wake_pipe[2] = {-1, -1}; // Interrupts the reader's poll()
+
+void pty_queue(const char *data, size_t len) {
+  if (master_fd >= 0)
+    buf_append(&pty_out, data, len);
+}
+
+void pty_flush() {
+  while (pty_out_sent < pty_out.len) {
+    ssize_t n = write(master_fd, pty_out.data + pty_out_sent,
+                      pty_out.len - pty_out_sent);
+    if (n > 0) {
+      pty_out_sent += n;
+    } else if (n < 0 && errno == EAGAIN) {
+      // Keep the rest for later and have the reader poll for POLLOUT
+      pty_out.len -= pty_out_sent;
+      memmove(pty_out.data, pty_out.data + pty_out_sent, pty_out.len);
+      pty_out_sent = 0;
+      if (!atomic_exchange(&pty_out_blocked, 1))
+        write(pty_wake_pipe[1], "", 1);
+      return;
+    } else if (n < 0 && errno != EINTR) {
+      break; // The shell is gone; drop the rest
+    }
+  }
+  pty_out.len = pty_out_sent = 0;
+}
+
+// --- PTY Reader ---
+// A reader thread drains the non-blocking master_fd into a single-producer/
+// single-consumer ring until EAGAIN, then sleeps in poll(). It wakes the main
+// thread with an SDL user event; the main thread feeds the ring into libvterm
+// within a per-iteration budget. head and tail only ever grow and are masked
+// on access.
+typedef struct {
+  char *data;
+  size_t mask;
+  _Atomic size_t head;      // Advanced by the reader thread
+  _Atomic size_t tail;      // Advanced by the main thread
+  atomic_int reader_waiting; // Reader is blocked on a full ring
+  atomic_int closed;         // The child hung up
+  atomic_int wakeup_pending; // A pty_event is queued and not yet handled
+} ByteRing;
+
+ByteRing pty_ring;
+SDL_sem *pty_space_sem; // Posted when the main thread frees space
+Uint32 pty_event;       // SDL user event type for "PTY has data"
+
+// At most one wakeup is queued at a time; the main thread re-arms it by
+// clearing wakeup_pending before it drains the ring.
+void pty_wakeup() {
+  if (atomic_exchange(&pty_ring.wakeup_pending, 1))
+    return;
+  SDL_Event ev = {0};
+  ev.type = pty_event;
+  SDL_PushEvent(&ev);
+}
+
+// Blocks the producer until the consumer moves tail past the given value.
+void ring_wait_space(ByteRing *ring, size_t tail) {
+  // Re-check after announcing ourselves so a concurrent consume that missed
+  // the flag cannot leave us waiting forever
+  atomic_store(&ring->reader_waiting, 1);
+  if (atomic_load(&ring->tail) == tail)
+    SDL_SemWait(pty_space_sem);
+  atomic_store(&ring->reader_waiting, 0);
+}
+
+int pty_reader(void *arg) {
+  ByteRing *ring = &pty_ring;
+  for (;;) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t space = ring->mask + 1 - (head - tail);
+    if (space == 0) {
+      ring_wait_space(ring, tail);
+      continue;
+    }
+
+    size_t idx = head & ring->mask;
+    size_t span = ring->mask + 1 - idx;
+    if (span > space)
+      span = space;
+    ssize_t len = read(master_fd, ring->data + idx, span);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+      struct pollfd pfds[2] = {{master_fd, POLLIN, 0},
+                               {pty_wake_pipe[0], POLLIN, 0}};
+      if (atomic_load(&pty_out_blocked))
+        pfds[0].events |= POLLOUT;
+      poll(pfds, 2, -1);
+      char drain[64];
+      if (pfds[1].revents & POLLIN)
+        while (read(pty_wake_pipe[0], drain, sizeof(drain)) > 0)
+          ;
+      if (pfds[0].revents & POLLOUT) {
+        atomic_store(&pty_out_blocked, 0);
+        pty_wakeup(); // The main loop flushes pty_out every iteration
+      }
+      continue;
+    }
+    if (len <= 0) {
+      // EIO means the slave side closed, i.e. the shell exited
+      atomic_store(&ring->closed, 1);
+      pty_wakeup();
+      return 0;
+    }
+
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+    pty_wakeup();
+  }
+}
+
+// Sets up the ring and starts fn as its producer.
+void start_ring_producer(SDL_ThreadFunction fn, const char *name) {
+  pty_ring.data = malloc(PTY_RING_SIZE);
+  pty_ring.mask = PTY_RING_SIZE - 1;
+  pty_event = SDL_RegisterEvents(1);
+  pty_space_sem = SDL_CreateSemaphore(0);
+  SDL_Thread *t = SDL_CreateThread(fn, name, NULL);
+  if (!t) {
+    printf("Failed to start %s: %s\n", name, SDL_GetError());
+    exit(1);
+  }
+  SDL_DetachThread(t);
+}
+
+void start_pty_reader() {
+  fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK);
+  if (pipe(pty_wake_pipe) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  fcntl(pty_wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(pty_wake_pipe[1], F_SETFL, O_NONBLOCK);
+  start_ring_producer(pty_reader, "pty-reader");
+}
+
+size_t pty_pending() {
+  return atomic_load_explicit(&pty_ring.head, memory_order_acquire) -
+         atomic_load_explicit(&pty_ring.tail, memory_order_relaxed);
+}
+
+// Feeds the ring to libvterm until it is empty or this iteration's byte/time
+// budget runs out. Returns bytes consumed.
+size_t pty_drain() {
+  static size_t budget = INGEST_MIN_BYTES;
+  ByteRing *ring = &pty_ring;
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t total = 0;
+  Uint64 start = SDL_GetPerformanceCounter();
+  Uint64 deadline = start + SDL_GetPerformanceFrequency() * INGEST_BUDGET_US /
+                                1000000;
+
+  while (total < budget) {
+    if (tail == head) {
+      // Pick up whatever the reader appended while we were parsing
+      head = atomic_load_explicit(&ring->head, memory_order_acquire);
+      if (tail == head)
+        break;
+    }
+    size_t idx = tail & ring->mask;
+    size_t span = ring->mask + 1 - idx;
+    if (span > head - tail)
+      span = head - tail;
+    if (span > INGEST_SLICE)
+      span = INGEST_SLICE;
+    if (span > budget - total)
+      span = budget - total;
+    vterm_input_write(vterm, ring->data + idx, span);
+    if (record_file)
+      record_write(RECORD_DATA, ring->data + idx, span);
+    tail += span;
+    total += span;
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    if (atomic_exchange(&ring->reader_waiting, 0))
+      SDL_SemPost(pty_space_sem);
+    if (SDL_GetPerformanceCounter() >= deadline)
+      break;
+  }
+
+  // Grow the budget while output backs up, shrink it once we keep up
+  if (pty_pending() && budget < INGEST_MAX_BYTES)
+    budget *= 2;
+  else if (!pty_pending() && budget > INGEST_MIN_BYTES)
+    budget /= 2;
+
+  if (total) {
+    vterm_screen_flush_damage(vterm_screen);
+    dirty = 1;
+  }
+  return total;
+}
+
+// --- Session Replay ---
+// --replay FILE feeds a recording through the ring in place of the shell, at
+// the recorded pace or, with --fast, as fast as the main thread parses.
+// Resizes are applied by the main thread once everything before them has
+// been parsed.
+const char *replay_path;
+char *replay_map; // The recording, checked by start_replay
+size_t replay_len;
+int replay_fast = 0;
+atomic_int replay_rows; // Pending resize for the main thread, 0 if none
+atomic_int replay_cols;
+SDL_sem *replay_resized;
+Uint64 replay_started;
+size_t replay_bytes;
+int replay_done = 0; // End of recording reported; the window stays open
+
+void ring_write(ByteRing *ring, const char *data, size_t len) {
+  while (len) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t space = ring->mask + 1 - (head - tail);
+    if (space == 0) {
+      ring_wait_space(ring, tail);
+      continue;
+    }
+    size_t idx = head & ring->mask;
+    size_t span = ring->mask + 1 - idx;
+    if (span > space)
+      span = space;
+    if (span > len)
+      span = len;
+    memcpy(ring->data + idx, data, span);
+    atomic_store_explicit(&ring->head, head + span, memory_order_release);
+    pty_wakeup();
+    data += span;
+    len -= span;
+  }
+}
+
+int replay_thread(void *arg) {
+  replay_started = SDL_GetPerformanceCounter();
+  Uint64 freq = SDL_GetPerformanceFrequency();
+  size_t off = 8;
+  RecordHeader rec;
+  const char *payload;
+  while ((payload = record_next(replay_map, replay_len, &off, &rec))) {
+    if (!replay_fast) {
+      Uint64 due = replay_started + rec.time_us * freq / 1000000;
+      Uint64 now;
+      while ((now = SDL_GetPerformanceCounter()) < due)
+        SDL_Delay((due - now) * 1000 / freq + 1);
+    }
+
+    if (rec.type == RECORD_DATA) {
+      ring_write(&pty_ring, payload, rec.len);
+      replay_bytes += rec.len;
+    } else if (rec.type == RECORD_RESIZE && rec.len == 2 * sizeof(int32_t)) {
+      int32_t size[2];
+      memcpy(size, payload, sizeof(size));
+      while (pty_pending())
+        SDL_Delay(1);
+      atomic_store(&replay_cols, size[1]);
+      atomic_store(&replay_rows, size[0]);
+      pty_wakeup();
+      SDL_SemWait(replay_resized);
+    }
+  }
+
+  munmap(replay_map, replay_len);
+  atomic_store(&pty_ring.closed, 1);
+  pty_wakeup();
+  return 0;
+}
+
+void start_replay() {
+  int fd = open(replay_path, O_RDONLY);
+  struct stat sb;
+  replay_map = MAP_FAILED;
+  if (fd != -1 && fstat(fd, &sb) == 0 && sb.st_size > 0)
+    replay_map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (fd != -1)
+    close(fd);
+  if (replay_map == MAP_FAILED || !is_recording(replay_map, sb.st_size)) {
+    printf("Not a recording: %s\n", replay_path);
+    exit(1);
+  }
+  replay_len = sb.st_size;
+  replay_resized = SDL_CreateSemaphore(0);
+  start_ring_producer(replay_thread, "replay");
+}
+
+int pty_hung_up() {
+  return atomic_load(&pty_ring.closed) &&
+         atomic_load(&pty_ring.head) == atomic_load(&pty_ring.tail);
+}
+
+// --- Coverage Expansion ---
+// SDL2 has no alpha-only texture format, so the atlas texture is ARGB8888
+// while the CPU copy stays single-channel. Uploads expand coverage to white
+// with alpha = coverage: 16 pixels per step with SSE2, 32 with AVX2 when the
+// CPU has it, and a scalar loop for the tail and other architectures.
+void expand_coverage_scalar(const unsigned char *src, Uint32 *dst, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = ((Uint32)src[i] << 24) | 0xFFFFFF;
+}
+
+#if defined(__SSE2__)
+void expand_coverage_sse2(const unsigned char *src, Uint32 *dst, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i white = _mm_set1_epi32(0xFFFFFF);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i lo = _mm_unpacklo_epi8(zero, a); // a << 8 in 16-bit lanes
+    __m128i hi = _mm_unpackhi_epi8(zero, a);
+    __m128i *out = (__m128i *)(dst + i);
+    _mm_storeu_si128(out, _mm_or_si128(_mm_unpacklo_epi16(zero, lo), white));
+    _mm_storeu_si128(out + 1,
+                     _mm_or_si128(_mm_unpackhi_epi16(zero, lo), white));
+    _mm_storeu_si128(out + 2,
+                     _mm_or_si128(_mm_unpacklo_epi16(zero, hi), white));
+    _mm_storeu_si128(out + 3,
+                     _mm_or_si128(_mm_unpackhi_epi16(zero, hi), white));
+  }
+  expand_coverage_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2"))) void
+expand_coverage_avx2(const unsigned char *src, Uint32 *dst, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i white = _mm256_set1_epi32(0xFFFFFF);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    // Unpacks stay within 128-bit lanes: reorder the quadwords so each lane
+    // unpacks to consecutive pixels, then pair the lanes up on store
+    __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+    a = _mm256_permute4x64_epi64(a, 0xD8);
+    __m256i lo = _mm256_unpacklo_epi8(zero, a); // Pixels 0-7 | 8-15
+    __m256i hi = _mm256_unpackhi_epi8(zero, a); // Pixels 16-23 | 24-31
+    __m256i p0 = _mm256_or_si256(_mm256_unpacklo_epi16(zero, lo), white);
+    __m256i p1 = _mm256_or_si256(_mm256_unpackhi_epi16(zero, lo), white);
+    __m256i p2 = _mm256_or_si256(_mm256_unpacklo_epi16(zero, hi), white);
+    __m256i p3 = _mm256_or_si256(_mm256_unpackhi_epi16(zero, hi), white);
+    __m256i *out = (__m256i *)(dst + i);
+    _mm256_storeu_si256(out, _mm256_permute2x128_si256(p0, p1, 0x20));
+    _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(p0, p1, 0x31));
+    _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(p2, p3, 0x20));
+    _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+  }
+  expand_coverage_scalar(src + i, dst + i, n - i);
+}
+#endif
+
+void (*expand_coverage)(const unsigned char *, Uint32 *,
+                        size_t) = expand_coverage_scalar;
+
+void expand_coverage_init() {
+#if defined(__SSE2__)
+  expand_coverage = SDL_HasAVX2() ? expand_coverage_avx2 : expand_coverage_sse2;
+#endif
+}
+
+// --- Glyph Cache ---
+// Glyphs are rasterized on first use into fixed-size atlas slots, one cell
+// high and two cells wide, and the least recently used slot is recycled when
+// the atlas is full. Entries are keyed by (glyph index, style, size).
+#define GLYPH_BUCKETS 8192 // Must be a power of two
+#define CODEPOINT_CACHE 1024
+
+enum { STYLE_REGULAR, STYLE_BOLD };
+
+typedef struct {
+  int glyph; // GLYPH_ID, -1 while the slot is free
+  int style;
+  float size;
+  int x0, y0, x1, y1; // Bitmap box relative to the pen, cropped to the slot
+  int ax, ay;         // Top-left of the slot in the atlas
+  Uint32 last_used;   // glyph_frame of the most recent lookup
+  Uint32 gen;         // Bumped when the slot is evicted; see Glyph Table
+  int next;           // Hash chain, -1 terminates
+} Glyph;
+
+Glyph *glyphs; // One per slot
+Uint32 glyph_epoch = 1; // Bumped when the atlas is reset; see Glyph Table
+int glyph_slots = 0;
+int glyph_slots_used = 0;
+int slot_w, slot_h;
+int glyph_buckets[GLYPH_BUCKETS];
+Uint32 glyph_frame = 1; // Bumped once per rendered frame
+
+// Direct-mapped codepoint -> glyph index cache in front of the cmap lookup
+struct {
+  uint32_t code;
+  int glyph;
+} codepoint_cache[CODEPOINT_CACHE];
+
+// Full, uncropped rasterization; one per rasterizing thread
+typedef struct {
+  unsigned char *data;
+  int len;
+} GlyphScratch;
+
+GlyphScratch glyph_scratch;
+Uint32 *glyph_upload; // ARGB staging for one slot
+
+unsigned glyph_hash(int glyph, int style, float size) {
+  unsigned bits;
+  memcpy(&bits, &size, sizeof(bits));
+  return (glyph * 2654435761u ^ style * 0x9E3779B9u ^ bits) &
+         (GLYPH_BUCKETS - 1);
+}
+
+// One pixel of padding right and below each slot keeps samples apart.
+// Distance fields also need room for their falloff on both sides.
+int slot_width(const FontMetrics *m) {
+  return 2 * m->cell_width + 1 + (sdf_atlas ? 2 * SDF_PADDING : 0);
+}
+
+int slot_count(int w, int h) {
+  return ATLAS_WIDTH / (w + 1) * (ATLAS_HEIGHT / (h + 1));
+}
+
+// Top-left corner of slot i among w x h slots
+void slot_origin(int i, int w, int h, int *ax, int *ay) {
+  int per_row = ATLAS_WIDTH / (w + 1);
+  *ax = (i % per_row) * (w + 1);
+  *ay = (i / per_row) * (h + 1);
+}
+
+void glyph_cache_init() {
+  glyph_epoch++;
+  slot_w = slot_width(&atlas_metrics);
+  slot_h = atlas_metrics.cell_height;
+  glyph_slots = slot_count(slot_w, slot_h);
+  glyph_slots_used = 0;
+  glyphs = realloc(glyphs, glyph_slots * sizeof(Glyph));
+  for (int i = 0; i < glyph_slots; i++) {
+    glyphs[i].glyph = -1;
+    glyphs[i].gen = 0;
+    slot_origin(i, slot_w, slot_h, &glyphs[i].ax, &glyphs[i].ay);
+  }
+  for (int i = 0; i < GLYPH_BUCKETS; i++)
+    glyph_buckets[i] = -1;
+  memset(codepoint_cache, 0, sizeof(codepoint_cache));
+  glyph_upload =
+      realloc(glyph_upload, (slot_w + 1) * (slot_h + 1) * sizeof(Uint32));
+}
+
+int glyph_index(uint32_t code) {
+  int i = code & (CODEPOINT_CACHE - 1);
+  if (codepoint_cache[i].code != code) {
+    codepoint_cache[i].code = code;
+    int face = coverage_face(code);
+    codepoint_cache[i].glyph =
+        face < 0 ? 0
+                 : GLYPH_ID(face, stbtt_FindGlyphIndex(&faces[face], code));
+  }
+  return codepoint_cache[i].glyph;
+}
+
+// Returns a free slot, evicting the least recently used glyph if needed.
+int glyph_take_slot() {
+  if (glyph_slots_used < glyph_slots)
+    return glyph_slots_used++;
+
+  int victim = 0;
+  for (int i = 1; i < glyph_slots; i++)
+    if (glyphs[i].last_used < glyphs[victim].last_used)
+      victim = i;
+
+  Glyph *g = &glyphs[victim];
+  g->gen++; // Glyph records may point at the victim
+  if (g->glyph >= 0) {
+    int *link = &glyph_buckets[glyph_hash(g->glyph, g->style, g->size)];
+    while (*link != victim)
+      link = &glyphs[*link].next;
+    *link = g->next;
+    g->glyph = -1;
+  }
+  return victim;
+}
+
+// Distance -> alpha for an SDF atlas at the current zoom, applied on upload
+Uint8 sdf_alpha[256];
+
+// Gives edges one screen pixel of antialiasing: the field rises
+// SDF_ON_EDGE / SDF_PADDING per atlas pixel, and an atlas pixel spans zoom
+// screen pixels.
+void sdf_build_ramp(float zoom) {
+  float per_pixel = (float)SDF_ON_EDGE / SDF_PADDING / zoom;
+  for (int d = 0; d < 256; d++) {
+    float a = 0.5f + (d - SDF_ON_EDGE) / per_pixel;
+    sdf_alpha[d] = a <= 0 ? 0 : a >= 1 ? 255 : (Uint8)(a * 255 + 0.5f);
+  }
+}
+
+// Converts atlas_bitmap pixels to what font_texture holds.
+void atlas_expand(const unsigned char *src, Uint32 *dst, size_t n) {
+  if (!sdf_atlas) {
+    expand_coverage(src, dst, n);
+    return;
+  }
+  for (size_t i = 0; i < n; i++)
+    dst[i] = ((Uint32)sdf_alpha[src[i]] << 24) | 0xFFFFFF;
+}
+
+// Atlas rows covered by the slots handed out so far.
+int atlas_rows_used() {
+  int rows = 0;
+  for (int i = 0; i < glyph_slots_used; i++)
+    if (glyphs[i].ay + slot_h + 1 > rows)
+      rows = glyphs[i].ay + slot_h + 1;
+  return rows < ATLAS_HEIGHT ? rows : ATLAS_HEIGHT;
+}
+
+// Re-sends the first rows of atlas_bitmap to font_texture in one upload.
+void atlas_upload_rows(int rows) {
+  if (rows <= 0)
+    return;
+  Uint32 *pixels = malloc((size_t)ATLAS_WIDTH * rows * 4);
+  atlas_expand(atlas_bitmap, pixels, (size_t)ATLAS_WIDTH * rows);
+  SDL_Rect rect = {0, 0, ATLAS_WIDTH, rows};
+  SDL_UpdateTexture(font_texture, &rect, pixels, ATLAS_WIDTH * 4);
+  free(pixels);
+}
+
+// Sends one slot, padding included, from atlas_bitmap to font_texture.
+void glyph_upload_slot(const Glyph *g) {
+  int w = slot_w + 1, h = slot_h + 1;
+  if (g->ax + w > ATLAS_WIDTH)
+    w = ATLAS_WIDTH - g->ax;
+  if (g->ay + h > ATLAS_HEIGHT)
+    h = ATLAS_HEIGHT - g->ay;
+  for (int y = 0; y < h; y++)
+    atlas_expand(atlas_bitmap + (g->ay + y) * ATLAS_WIDTH + g->ax,
+                 glyph_upload + y * w, w);
+  SDL_Rect rect = {g->ax, g->ay, w, h};
+  SDL_UpdateTexture(font_texture, &rect, glyph_upload, w * sizeof(Uint32));
+}
+
+int atlas_cache_stale = 0; // Slots changed since the atlas cache was loaded
+
+// Rasterizes a glyph at m into the slot at dst, whose rows are pitch bytes
+// apart, cropped to the cell, and fills in g's box. Touches no globals but
+// the font, so worker threads can call it with their own scratch.
+void glyph_render(const FontMetrics *m, int glyph, int style,
+                  unsigned char *dst, int pitch, Glyph *g,
+                  GlyphScratch *scratch) {
+  int slot_w = slot_width(m), slot_h = m->cell_height;
+  const stbtt_fontinfo *font = &faces[GLYPH_FACE(glyph)];
+  // Fallback faces are scaled to the same pixel height as the primary
+  float scale =
+      font == faces ? m->scale : stbtt_ScaleForPixelHeight(font, m->size);
+  glyph = GLYPH_INDEX(glyph);
+  int x0 = 0, y0 = 0, x1, y1, w = 0, h = 0;
+  unsigned char *bitmap = scratch->data;
+  if (sdf_atlas) {
+    bitmap = stbtt_GetGlyphSDF(font, scale, glyph, SDF_PADDING,
+                               SDF_ON_EDGE, (float)SDF_ON_EDGE / SDF_PADDING,
+                               &w, &h, &x0, &y0);
+    if (!bitmap)
+      w = h = 0;
+    x1 = x0 + w;
+    y1 = y0 + h;
+  } else {
+    stbtt_GetGlyphBitmapBox(font, glyph, scale, scale, &x0, &y0, &x1, &y1);
+    w = x1 - x0, h = y1 - y0;
+    if (w * h > scratch->len) {
+      scratch->len = w * h;
+      scratch->data = bitmap = realloc(scratch->data, scratch->len);
+    }
+    if (w > 0 && h > 0)
+      stbtt_MakeGlyphBitmap(font, bitmap, w, h, w, scale, scale, glyph);
+  }
+
+  // Crop to the slot: rows outside the cell and columns past two cells
+  int top = y0 < -m->baseline ? -m->baseline - y0 : 0;
+  int bottom = y1 > m->cell_height - m->baseline
+                   ? y1 - (m->cell_height - m->baseline)
+                   : 0;
+  int cw = w < slot_w ? w : slot_w;
+  g->x0 = x0;
+  g->x1 = x0 + cw;
+  g->y0 = y0 + top;
+  g->y1 = y1 - bottom;
+  if (g->y1 < g->y0)
+    g->y1 = g->y0;
+
+  for (int y = 0; y < slot_h; y++)
+    memset(dst + y * pitch, 0, slot_w);
+  for (int y = 0; y < g->y1 - g->y0; y++) {
+    unsigned char *out = dst + y * pitch;
+    memcpy(out, bitmap + (top + y) * w, cw);
+    // Synthetic bold: smear coverage one pixel to the right
+    if (style == STYLE_BOLD) {
+      for (int x = cw < slot_w ? cw : slot_w - 1; x > 0; x--)
+        if (out[x - 1] > out[x])
+          out[x] = out[x - 1];
+    }
+  }
+  if (style == STYLE_BOLD && g->x1 - g->x0 < slot_w && g->y1 > g->y0)
+    g->x1++;
+  if (sdf_atlas)
+    stbtt_FreeSDF(bitmap, NULL);
+}
+
+Glyph *glyph_rasterize(int glyph, int style) {
+  atlas_cache_stale = 1;
+  frame_stats.rasterized++;
+  Glyph *g = &glyphs[glyph_take_slot()];
+  g->glyph = glyph;
+  g->style = style;
+  g->size = atlas_metrics.size;
+  glyph_render(&atlas_metrics, glyph, style,
+               atlas_bitmap + g->ay * ATLAS_WIDTH + g->ax, ATLAS_WIDTH, g,
+               &glyph_scratch);
+  glyph_upload_slot(g);
+  return g;
+}
+
+// Files slot i under (glyph, style) at the atlas size; the caller sets the
+// box and the slot's pixels.
+Glyph *glyph_install(int i, int glyph, int style) {
+  Glyph *g = &glyphs[i];
+  g->glyph = glyph;
+  g->style = style;
+  g->size = atlas_metrics.size;
+  g->last_used = 0;
+  unsigned h = glyph_hash(glyph, style, g->size);
+  g->next = glyph_buckets[h];
+  glyph_buckets[h] = i;
+  return g;
+}
+
+// Finds or rasterizes a glyph and marks it used in the current frame.
+Glyph *glyph_get(int glyph, int style) {
+  unsigned h = glyph_hash(glyph, style, atlas_metrics.size);
+  Glyph *g = NULL;
+  for (int i = glyph_buckets[h]; i >= 0; i = glyphs[i].next) {
+    if (glyphs[i].glyph == glyph && glyphs[i].style == style &&
+        glyphs[i].size == atlas_metrics.size) {
+      g = &glyphs[i];
+      break;
+    }
+  }
+  if (!g) {
+    g = glyph_rasterize(glyph, style);
+    g->next = glyph_buckets[h];
+    glyph_buckets[h] = g - glyphs;
+  }
+  g->last_used = glyph_frame;
+  return g;
+}
+
+// --- Glyph Table ---
+// What the grid draws for a (codepoint, style): the atlas slot and its quad,
+// already scaled to the cell and clipped to the row, with texture coordinates
+// worked out. Pages of 256 codepoints are allocated on first use; untouched
+// pages share glyph_page_empty, whose records are never current, so a lookup
+// is the page load and the record load. Records are recomputed on use once
+// glyph_epoch moves on after an atlas reset or a zoom, or once their own slot
+// is evicted.
+typedef struct {
+  float x0, y0, x1, y1; // Quad relative to the cell's top-left corner
+  float s0, t0, s1, t1;
+  int slot;     // -1 when there is nothing to draw
+  Uint32 gen;   // The slot's gen when the record was filled in
+  Uint32 epoch; // Current while equal to glyph_epoch
+} GlyphRecord;
+
+#define GLYPH_PAGES (0x110000 >> 8)
+
+GlyphRecord glyph_page_empty[256];
+GlyphRecord *glyph_table[2][GLYPH_PAGES];
+
+void glyph_table_init() {
+  for (int style = 0; style < 2; style++)
+    for (int i = 0; i < GLYPH_PAGES; i++)
+      glyph_table[style][i] = glyph_page_empty;
+}
+
+// Fills in the record for code from the glyph cache.
+GlyphRecord *glyph_resolve(uint32_t code, int style) {
+  GlyphRecord **page = &glyph_table[style][code >> 8];
+  if (*page == glyph_page_empty)
+    *page = calloc(256, sizeof(GlyphRecord));
+  GlyphRecord *r = &(*page)[code & 255];
+  int gi = glyph_index(code);
+  Glyph *g = gi ? glyph_get(gi, style) : NULL;
+  // glyph_get may have evicted a slot; this record is current either way
+  r->epoch = glyph_epoch;
+  r->slot = -1;
+  if (!g || g->x1 <= g->x0 || g->y1 <= g->y0)
+    return r;
+
+  // Scale from the size the slot was rasterized at and clip to the cell
+  float k = font_size / g->size;
+  float y0 = baseline + g->y0 * k, y1 = baseline + g->y1 * k;
+  float t0 = g->ay, t1 = g->ay + g->y1 - g->y0; // In atlas pixels
+  if (y0 < 0) {
+    t0 -= y0 / k;
+    y0 = 0;
+  }
+  if (y1 > cell_height) {
+    t1 -= (y1 - cell_height) / k;
+    y1 = cell_height;
+  }
+  *r = (GlyphRecord){g->x0 * k,
+                     y0,
+                     g->x1 * k,
+                     y1,
+                     (float)g->ax / ATLAS_WIDTH,
+                     t0 / ATLAS_HEIGHT,
+                     (float)(g->ax + g->x1 - g->x0) / ATLAS_WIDTH,
+                     t1 / ATLAS_HEIGHT,
+                     g - glyphs,
+                     g->gen,
+                     glyph_epoch};
+  return r;
+}
+
+// Codepoints past Unicode must be filtered out by the caller.
+static inline GlyphRecord *glyph_lookup(uint32_t code, int style) {
+  GlyphRecord *r = &glyph_table[style][code >> 8][code & 255];
+  if (r->epoch == glyph_epoch && (r->slot < 0 || glyphs[r->slot].gen == r->gen))
+    return r;
+  return glyph_resolve(code, style);
+}
+
+// --- Atlas Cache ---
+// The resident glyph set is saved on exit to a file keyed by a hash of the
+// font data and the size, and mapped back in on the next launch so a new
+// terminal starts with a warm atlas. Layout: header, one CachedGlyph per used
+// slot, then the coverage bitmap at a page-aligned offset so it can be mapped
+// copy-on-write straight into atlas_bitmap.
+#define ATLAS_CACHE_MAGIC "OOLATL01"
+
+typedef struct {
+  char magic[8];
+  uint64_t key;
+  int32_t atlas_width, atlas_height;
+  int32_t cell_width, cell_height, baseline;
+  int32_t slot_w, slot_h, slots_used;
+  int32_t bitmap_rows; // Atlas rows actually written; the rest is a hole
+} AtlasCacheHeader;
+
+typedef struct {
+  int32_t glyph, style;
+  int32_t x0, y0, x1, y1;
+} CachedGlyph;
+
+int atlas_cache_enabled = 1; // Off for benches, which measure a cold atlas
+
+uint64_t hash_bytes(const unsigned char *p, size_t len) {
+  uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+    h ^= h >> 32;
+  }
+  for (; i < len; i++)
+    h = (h ^ p[i]) * 0x100000001B3ull;
+  return h;
+}
+
+uint64_t atlas_cache_key() {
+  uint32_t size_bits;
+  memcpy(&size_bits, &atlas_metrics.size, sizeof(size_bits));
+  uint64_t key = font_key ^ size_bits * 0xC2B2AE3D27D4EB4Full;
+  return sdf_atlas ? ~key : key;
+}
+
+// Fills path with the cache file name, creating the directory. Returns 0 if
+// there is nowhere to put it.
+int atlas_cache_path(char *path, size_t len, uint64_t key) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[4096];
+  if (xdg && *xdg)
+    snprintf(dir, sizeof(dir), "%s", xdg);
+  else if (home && *home)
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  else
+    return 0;
+  mkdir(dir, 0755);
+  snprintf(path, len, "%s/%s", dir, ATLAS_CACHE_DIR);
+  mkdir(path, 0755);
+  snprintf(path, len, "%s/%s/atlas-%016llx.bin", dir, ATLAS_CACHE_DIR,
+           (unsigned long long)key);
+  return 1;
+}
+
+size_t atlas_cache_bitmap_offset(int slots_used) {
+  size_t table = sizeof(AtlasCacheHeader) + slots_used * sizeof(CachedGlyph);
+  long page = sysconf(_SC_PAGESIZE);
+  return (table + page - 1) / page * page;
+}
+
+int atlas_bitmap_mapped = 0; // atlas_bitmap came from mmap, not calloc
+
+// Restores the slot table and maps the cached coverage over atlas_bitmap.
+// Must run right after glyph_cache_init(). Returns 1 on a hit.
+int atlas_cache_load() {
+  char path[4096];
+  uint64_t key = atlas_cache_key();
+  if (!atlas_cache_enabled || !atlas_cache_path(path, sizeof(path), key))
+    return 0;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+
+  AtlasCacheHeader hdr;
+  struct stat sb;
+  int ok = fstat(fd, &sb) == 0 && read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+           memcmp(hdr.magic, ATLAS_CACHE_MAGIC, 8) == 0 &&
+           hdr.key == key && hdr.atlas_width == ATLAS_WIDTH &&
+           hdr.atlas_height == ATLAS_HEIGHT &&
+           hdr.cell_width == atlas_metrics.cell_width &&
+           hdr.cell_height == atlas_metrics.cell_height &&
+           hdr.baseline == atlas_metrics.baseline && hdr.slot_w == slot_w &&
+           hdr.slot_h == slot_h && hdr.slots_used >= 0 &&
+           hdr.slots_used <= glyph_slots && hdr.bitmap_rows >= 0 &&
+           hdr.bitmap_rows <= ATLAS_HEIGHT;
+  size_t offset = ok ? atlas_cache_bitmap_offset(hdr.slots_used) : 0;
+  ok = ok && (size_t)sb.st_size >= offset + ATLAS_WIDTH * ATLAS_HEIGHT;
+
+  CachedGlyph *table = NULL;
+  if (ok) {
+    size_t len = hdr.slots_used * sizeof(CachedGlyph);
+    table = malloc(len + 1);
+    ok = read(fd, table, len) == (ssize_t)len;
+    // Ids from another set of fallback faces would index past faces[]
+    for (int i = 0; ok && i < hdr.slots_used; i++)
+      ok = table[i].glyph >= 0 && GLYPH_FACE(table[i].glyph) < face_count &&
+           (table[i].style == STYLE_REGULAR || table[i].style == STYLE_BOLD);
+  }
+  unsigned char *bitmap = MAP_FAILED;
+  if (ok)
+    bitmap = mmap(NULL, ATLAS_WIDTH * ATLAS_HEIGHT, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE, fd, offset);
+  close(fd);
+  if (bitmap == MAP_FAILED) {
+    free(table);
+    return 0;
+  }
+
+  if (atlas_bitmap_mapped)
+    munmap(atlas_bitmap, ATLAS_WIDTH * ATLAS_HEIGHT);
+  else
+    free(atlas_bitmap);
+  atlas_bitmap = bitmap;
+  atlas_bitmap_mapped = 1;
+  for (int i = 0; i < hdr.slots_used; i++) {
+    Glyph *g = glyph_install(i, table[i].glyph, table[i].style);
+    g->x0 = table[i].x0;
+    g->y0 = table[i].y0;
+    g->x1 = table[i].x1;
+    g->y1 = table[i].y1;
+  }
+  glyph_slots_used = hdr.slots_used;
+  free(table);
+
+  // One upload for every row that holds cached slots
+  atlas_upload_rows(hdr.bitmap_rows);
+  atlas_cache_stale = 0;
+  return 1;
+}
+
+// Writes the resident glyph set if it changed since load. The file is written
+// under a temporary name and renamed so concurrent terminals never see a torn
+// cache.
+void atlas_cache_save() {
+  char path[4096], tmp[4200];
+  uint64_t key = atlas_cache_key();
+  if (!atlas_cache_enabled || !atlas_cache_stale ||
+      !atlas_cache_path(path, sizeof(path), key))
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    return;
+
+  int used = glyph_slots_used;
+  int rows = atlas_rows_used();
+  size_t len = used * sizeof(CachedGlyph);
+  CachedGlyph *table = malloc(len + 1);
+  for (int i = 0; i < used; i++) {
+    Glyph *g = &glyphs[i];
+    table[i] = (CachedGlyph){g->glyph, g->style, g->x0, g->y0, g->x1, g->y1};
+  }
+
+  AtlasCacheHeader hdr = {ATLAS_CACHE_MAGIC,
+                          key,
+                          ATLAS_WIDTH,
+                          ATLAS_HEIGHT,
+                          atlas_metrics.cell_width,
+                          atlas_metrics.cell_height,
+                          atlas_metrics.baseline,
+                          slot_w,
+                          slot_h,
+                          used,
+                          rows};
+  size_t offset = atlas_cache_bitmap_offset(used);
+  size_t bitmap_len = (size_t)ATLAS_WIDTH * rows;
+  int ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+           write(fd, table, len) == (ssize_t)len &&
+           pwrite(fd, atlas_bitmap, bitmap_len, offset) ==
+               (ssize_t)bitmap_len &&
+           ftruncate(fd, offset + ATLAS_WIDTH * ATLAS_HEIGHT) == 0;
+  free(table);
+  close(fd);
+  if (!ok || rename(tmp, path) != 0)
+    unlink(tmp);
+}
+
+// --- Font Loading ---
+FontMetrics font_metrics(float size) {
+  FontMetrics m = {size, stbtt_ScaleForPixelHeight(&faces[0], size)};
+  int advance, lsb;
+  stbtt_GetCodepointHMetrics(&faces[0], ' ', &advance, &lsb);
+  m.cell_width = (int)ceilf(advance * m.scale);
+  if (m.cell_width == 0)
+    m.cell_width = (int)ceilf(size / 2);
+  m.cell_height = (int)size;
+  m.baseline = (int)floorf(m.cell_height * 0.75f + 0.5f);
+  return m;
+}
+
+// Makes m the grid's cell geometry.
+void font_use_metrics(FontMetrics m) {
+  font_size = m.size;
+  font_scale = m.scale;
+  cell_width = m.cell_width;
+  cell_height = m.cell_height;
+  baseline = m.baseline;
+}
+
+SDL_Texture *atlas_create_texture() {
+  SDL_Texture *t =
+      SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                        SDL_TEXTUREACCESS_STATIC, ATLAS_WIDTH, ATLAS_HEIGHT);
+  SDL_SetTextureBlendMode(t, SDL_BLENDMODE_BLEND);
+  return t;
+}
+
+// Lays the atlas out for the current mode and size, starting from the atlas
+// cache when it has a match. Returns 1 on a cache hit.
+int atlas_setup() {
+  atlas_metrics = font_metrics(sdf_atlas ? SDF_SIZE : font_size);
+  // Distance fields are scaled, so they need filtering between texels
+  SDL_SetTextureScaleMode(font_texture, sdf_atlas ? SDL_ScaleModeLinear
+                                                  : SDL_ScaleModeNearest);
+  sdf_build_ramp(font_size / atlas_metrics.size);
+  glyph_cache_init();
+  return atlas_cache_load();
+}
+
+// Switches the grid to another font size. An SDF atlas serves every size up
+// to SDF_SIZE, but SDL2 can only filter what the texture holds, so the alpha
+// ramp is applied on upload and the whole used atlas is re-uploaded here on
+// every step (--bench-zoom times it). A coverage atlas is drawn scaled until
+// a rebuild at the new size replaces it (see Atlas Rebuild).
+void font_set_size(float size) {
+  font_use_metrics(font_metrics(size));
+  glyph_epoch++; // Glyph records are laid out for the old cell size
+  if (sdf_atlas) {
+    sdf_build_ramp(size / atlas_metrics.size);
+    atlas_upload_rows(atlas_rows_used());
+  }
+  // Cells changed size, so the frame is reallocated on the next render
+  if (frame_texture)
+    SDL_DestroyTexture(frame_texture);
+  frame_texture = NULL;
+  dirty = 1;
+}
+
+// Marks the codepoints in [start, end] that face has glyphs for, unless an
+// earlier face already covers them.
+void coverage_add_range(int face, uint32_t start, uint32_t end) {
+  if (end > 0x10FFFF)
+    end = 0x10FFFF;
+  for (uint32_t code = start; code <= end; code++) {
+    unsigned char **page = &coverage[code >> 8];
+    if ((*page && (*page)[code & 255]) ||
+        !stbtt_FindGlyphIndex(&faces[face], code))
+      continue;
+    if (!*page)
+      *page = calloc(256, 1);
+    (*page)[code & 255] = face + 1;
+  }
+}
+
+// Walks the ranges of the cmap subtable stb_truetype picked for the face.
+void coverage_add_face(int face) {
+  const stbtt_fontinfo *f = &faces[face];
+  stbtt_uint8 *map = f->data + f->index_map;
+  int format = ttUSHORT(map);
+  if (format == 4) {
+    int segs = ttUSHORT(map + 6) / 2;
+    for (int i = 0; i < segs; i++)
+      coverage_add_range(face, ttUSHORT(map + 16 + segs * 2 + i * 2),
+                         ttUSHORT(map + 14 + i * 2));
+  } else if (format == 12 || format == 13) {
+    stbtt_uint32 groups = ttULONG(map + 12);
+    for (stbtt_uint32 i = 0; i < groups; i++)
+      coverage_add_range(face, ttULONG(map + 16 + i * 12),
+                         ttULONG(map + 20 + i * 12));
+  } else {
+    coverage_add_range(face, 0, 0xFFFF); // Small legacy tables
+  }
+}
+
+// Maps a font file and adds its faces. Returns 0 if it cannot be used.
+int font_open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) == -1) {
+    if (fd != -1)
+      close(fd);
+    return 0;
+  }
+  unsigned char *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 0;
+  int n = stbtt_GetNumberOfFonts(data), added = 0;
+  for (int i = 0; i < n && face_count < MAX_FACES; i++) {
+    int offset = stbtt_GetFontOffsetForIndex(data, i);
+    if (offset >= 0 && stbtt_InitFont(&faces[face_count], data, offset)) {
+      coverage_add_face(face_count++);
+      added++;
+    }
+  }
+  if (!added) {
+    munmap(data, sb.st_size);
+    return 0;
+  }
+  if (face_count == added) {
+    // Hashed once here rather than on every cache load and save
+    ttf_buffer = data;
+    ttf_size = sb.st_size;
+    font_key = hash_bytes(ttf_buffer, ttf_size);
+  } else {
+    // Cached glyph ids are only valid for the same fallback files
+    uint64_t id[2] = {(uint64_t)sb.st_size, (uint64_t)sb.st_mtime};
+    font_key = font_key * 31 + hash_bytes((const void *)id, sizeof(id)) +
+               hash_bytes((const void *)path, strlen(path));
+  }
+  return 1;
+}
+
+void load_fallbacks() {
+  const char *env = getenv("OOLONG_FONTS");
+  if (env) {
+    char *list = strdup(env);
+    for (char *p = strtok(list, ":"); p; p = strtok(NULL, ":"))
+      font_open(p);
+    free(list);
+    return;
+  }
+  const char *paths[] = FONT_FALLBACKS;
+  for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+    font_open(paths[i]);
+}
+
+void load_font() {
+  if (!font_open(FONT_PATH)) {
+    printf("Failed to load font: %s\n", FONT_PATH);
+    exit(1);
+  }
+  int primary = face_count;
+  load_fallbacks();
+
+  font_use_metrics(font_metrics(font_size));
+  expand_coverage_init();
+  glyph_table_init();
+  atlas_bitmap = calloc(1, ATLAS_WIDTH * ATLAS_HEIGHT);
+  font_texture = atlas_create_texture();
+  int cached = atlas_setup();
+
+  printf("Font loaded%s, %d fallback faces. Cell size: %dx%d\n",
+         cached ? " from cache" : "", face_count - primary, cell_width,
+         cell_height);
+}
+
+// --- Damage Tracking ---
+// The frame_texture row showing a view row.
+int frame_row(int row) {
+  int p = row + frame_top;
+  return p >= dirty_rows_len ? p - dirty_rows_len : p;
+}
+
+void mark_rows_dirty(int start_row, int end_row) {
+  if (start_row < 0)
+    start_row = 0;
+  if (end_row > dirty_rows_len)
+    end_row = dirty_rows_len;
+  if (start_row < end_row) {
+    // The range may wrap around the bottom of the ring
+    int p = frame_row(start_row), n = end_row - start_row;
+    int first = n < dirty_rows_len - p ? n : dirty_rows_len - p;
+    memset(dirty_rows + p, 1, first);
+    memset(dirty_rows, 1, n - first);
+  }
+  dirty = 1;
+}
+
+void mark_all_dirty() {
+  int rows, cols;
+  vterm_get_size(vterm, &rows, &cols);
+  if (rows != dirty_rows_len) {
+    dirty_rows = realloc(dirty_rows, rows);
+    dirty_rows_len = rows;
+    frame_top = 0;
+  }
+  mark_rows_dirty(0, rows);
+}
+
+// Scrolls the whole frame by n rows (up if positive) by rotating the ring;
+// no pixels move. Rows that should not have moved must be marked dirty, and
+// the shadow grid skips any that happen to match already.
+void frame_rotate(int n) {
+  if (!dirty_rows_len)
+    return;
+  frame_top = ((frame_top + n) % dirty_rows_len + dirty_rows_len) %
+              dirty_rows_len;
+}
+
+// Handles a libvterm moverect of full-width rows by rotating the frame, then
+// redrawing the rows outside the moved region. Returns 0 when that would
+// redraw more rows than just repainting the destination.
+int frame_scroll(VTermRect dest, VTermRect src) {
+  int rows = dirty_rows_len;
+  if (rows != frame_rows || dest.start_col != 0 || src.start_col != 0 ||
+      dest.end_col != frame_cols || src.end_col != frame_cols)
+    return 0;
+  int n = src.start_row - dest.start_row;
+  int top = n > 0 ? dest.start_row : src.start_row;
+  int bottom = n > 0 ? src.end_row : dest.end_row;
+  if (n == 0 || top + rows - bottom >= dest.end_row - dest.start_row)
+    return 0;
+  frame_rotate(n);
+  mark_rows_dirty(0, top);
+  mark_rows_dirty(bottom, rows);
+  // The rows the move exposed arrive as damage from libvterm
+  return 1;
+}
+
+// The shadow grid holds the resolved cells each row of frame_texture was
+// last drawn from, with a hash per row. A damaged row that resolves to the
+// same cells is not redrawn; the hash only rules out changed rows quickly.
+// Glyphs are looked up only when a row is drawn, as the atlas may have moved
+// them since.
+typedef struct {
+  uint32_t code; // First codepoint
+  Uint32 fg, bg; // 0xRRGGBB
+  uint32_t attrs; // SB_* flags
+} ShadowCell;
+
+ShadowCell *shadow = NULL; // frame_rows x frame_cols
+uint64_t *shadow_hash = NULL;
+unsigned char *shadow_valid = NULL; // Row drawn and its pixels still there
+
+// Forgets what frame_texture shows, e.g. when the renderer lost it.
+void shadow_invalidate() {
+  if (shadow_valid)
+    memset(shadow_valid, 0, frame_rows);
+  mark_all_dirty();
+}
+
+// Redraws only the rows that show a glyph, for when the atlas changes under
+// them; blank rows keep their pixels.
+void shadow_invalidate_glyphs() {
+  for (int row = 0; row < frame_rows && row < dirty_rows_len; row++) {
+    if (!shadow_valid[row])
+      continue; // Redrawn anyway
+    const ShadowCell *cells = shadow + (size_t)row * frame_cols;
+    for (int col = 0; col < frame_cols; col++) {
+      if (cells[col].code > ' ' && cells[col].code != (uint32_t)-1) {
+        shadow_valid[row] = 0;
+        dirty_rows[row] = 1;
+        dirty = 1;
+        break;
+      }
+    }
+  }
+}
+
+// (Re)create the frame texture when the grid size changes. Its contents are
+// undefined afterwards, so every row is marked dirty.
+void ensure_frame_texture(int rows, int cols) {
+  if (frame_texture && frame_rows == rows && frame_cols == cols)
+    return;
+  if (frame_texture)
+    SDL_DestroyTexture(frame_texture);
+  frame_texture =
+      SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                        SDL_TEXTUREACCESS_TARGET, cols * cell_width,
+                        rows * cell_height);
+  frame_rows = rows;
+  frame_cols = cols;
+  frame_top = 0;
+  shadow = realloc(shadow, (size_t)rows * cols * sizeof(ShadowCell));
+  shadow_hash = realloc(shadow_hash, rows * sizeof(uint64_t));
+  shadow_valid = realloc(shadow_valid, rows);
+  shadow_invalidate();
+}
+
+// --- Scrollback ---
+// Lines pushed off the top are packed into SbBlocks of SB_BLOCK_LINES lines.
+// A packed line is an SbLineHeader, then runs of identical attributes and
+// colors, then one UTF-8 character per cell (SB_WIDE_CONT for the right half
+// of a wide character, SB_COMBINING before each combining codepoint).
+// Trailing blank cells are dropped. A full block is sealed by appending its
+// line offsets to the data; blocks older than SB_HOT_BLOCKS are then
+// LZ-compressed, and once over the memory budget appended to the spill file,
+// leaving just the SbBlock in memory. Lookups are O(1) because only the
+// newest block is partial, and reading a spilled block maps only its pages.
+// Each block also carries a bloom filter of the trigrams in its text, kept
+// next to the data when spilled, so search can skip blocks unread.
+#define SB_BLOCK_LINES 256
+#define SB_HOT_BLOCKS 4
+#define SB_WIDE_CONT 0xFF // Neither byte can occur in UTF-8
+#define SB_COMBINING 0xFE
+#define SB_SPILL_MAP_MIN (64 << 20) // Initial spill file mapping
+#define SB_BLOOM_LOG2 14
+#define SB_BLOOM_BITS (1 << SB_BLOOM_LOG2)
+#define SB_BLOOM_BYTES (SB_BLOOM_BITS / 8)
+
+enum {
+  SB_BOLD = 1 << 0,
+  SB_UNDERLINE = 1 << 1,
+  SB_ITALIC = 1 << 2,
+  SB_REVERSE = 1 << 3,
+  SB_STRIKE = 1 << 4,
+  SB_BLINK = 1 << 5,
+  SB_CONCEAL = 1 << 6,
+};
+
+// A cell's attributes as SB_* flags, shared with the shadow grid
+static inline uint8_t cell_attr_bits(const VTermScreenCell *cell) {
+  return (cell->attrs.bold ? SB_BOLD : 0) |
+         (cell->attrs.underline ? SB_UNDERLINE : 0) |
+         (cell->attrs.italic ? SB_ITALIC : 0) |
+         (cell->attrs.reverse ? SB_REVERSE : 0) |
+         (cell->attrs.strike ? SB_STRIKE : 0) |
+         (cell->attrs.blink ? SB_BLINK : 0) |
+         (cell->attrs.conceal ? SB_CONCEAL : 0);
+}
+
+typedef struct {
+  uint16_t cells;
+  uint16_t runs;
+  uint16_t text; // Bytes of text after the runs
+} SbLineHeader;
+
+typedef struct {
+  uint16_t count;
+  uint8_t attrs;
+  uint8_t fg[3], bg[3];
+} SbRun;
+
+typedef struct {
+  uint8_t *data; // Packed lines, plus offsets once sealed; LZ data when
+                 // compressed; NULL when spilled
+  size_t len;    // Bytes of data, in memory or in the spill file
+  size_t cap;
+  size_t raw_len;    // Uncompressed size
+  uint64_t file_off; // Position in the spill file, bloom after the data
+  uint8_t *bloom;    // NULL when spilled
+  int lines;
+  uint8_t compressed;
+  uint8_t spilled;
+} SbBlock;
+
+SbBlock **sb_blocks = NULL; // Oldest first; spilled blocks form a prefix
+int sb_nblocks = 0;
+int sb_blocks_cap = 0;
+int sb_spilled = 0;   // Leading blocks that live in the spill file
+long sb_lines = 0;    // Lines held
+long sb_dropped = 0;  // Lines dropped from the oldest end; line i of the
+                      // history is absolute line sb_dropped + i
+size_t sb_bytes = 0;  // Block data held in memory
+int scroll_offset = 0; // Lines the view is scrolled back, 0 = live screen
+SDL_mutex *sb_lock;    // Held while the scrollback is read or changed, as
+                       // the search worker reads it too
+
+// Line starts in the newest block, which is never sealed
+uint32_t sb_offsets[SB_BLOCK_LINES + 1];
+
+int sb_spill_fd = -1;
+int sb_spill_failed = 0; // Out of disk: drop history like before
+uint64_t sb_spill_size = 0;
+const uint8_t *sb_spill_map = NULL;
+size_t sb_spill_map_len = 0;
+
+// Last block decompressed for reading
+SbBlock *sb_cache_block = NULL;
+uint8_t *sb_cache_data = NULL;
+size_t sb_cache_cap = 0;
+
+// LZ77 in the LZ4 block layout: a token of literal and match length nibbles,
+// extra length bytes for 15, the literals, then a 16-bit match offset.
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+size_t lz_bound(size_t n) { return n + n / 255 + 16; }
+
+void lz_put_len(uint8_t **op, size_t len) {
+  for (; len >= 255; len -= 255)
+    *(*op)++ = 255;
+  *(*op)++ = len;
+}
+
+void lz_put_literals(uint8_t **op, const uint8_t *lit, size_t n, int match) {
+  **op = (n < 15 ? n : 15) << 4 | (match < 15 ? match : 15);
+  (*op)++;
+  if (n >= 15)
+    lz_put_len(op, n - 15);
+  memcpy(*op, lit, n);
+  *op += n;
+}
+
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+  uint32_t table[1 << LZ_HASH_BITS] = {0}; // Position + 1 of each hash
+  uint8_t *op = dst;
+  size_t anchor = 0, i = 0;
+  while (i + LZ_MIN_MATCH <= n) {
+    uint32_t seq;
+    memcpy(&seq, src + i, 4);
+    uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+    size_t cand = table[h];
+    table[h] = i + 1;
+    if (!cand || i - (cand - 1) > 0xFFFF ||
+        memcmp(src + cand - 1, src + i, LZ_MIN_MATCH) != 0) {
+      i++;
+      continue;
+    }
+    cand--;
+    size_t len = LZ_MIN_MATCH;
+    while (i + len < n && src[cand + len] == src[i + len])
+      len++;
+    lz_put_literals(&op, src + anchor, i - anchor, len - LZ_MIN_MATCH);
+    *op++ = (i - cand) & 0xFF;
+    *op++ = (i - cand) >> 8;
+    if (len - LZ_MIN_MATCH >= 15)
+      lz_put_len(&op, len - LZ_MIN_MATCH - 15);
+    i += len;
+    anchor = i;
+  }
+  lz_put_literals(&op, src + anchor, n - anchor, 0);
+  return op - dst;
+}
+
+void lz_decompress(const uint8_t *src, size_t n, uint8_t *dst) {
+  const uint8_t *ip = src, *end = src + n;
+  uint8_t *op = dst;
+  while (ip < end) {
+    unsigned token = *ip++;
+    size_t lit = token >> 4;
+    if (lit == 15)
+      for (unsigned b = 255; b == 255; lit += b)
+        b = *ip++;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip >= end)
+      break;
+    size_t off = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t len = token & 15;
+    if (len == 15)
+      for (unsigned b = 255; b == 255; len += b)
+        b = *ip++;
+    // Matches may overlap their own output, so copy bytewise
+    const uint8_t *m = op - off;
+    for (len += LZ_MIN_MATCH; len; len--)
+      *op++ = *m++;
+  }
+}
+
+void sb_block_compress(SbBlock *b) {
+  if (b->compressed || b->spilled)
+    return;
+  uint8_t *out = malloc(lz_bound(b->len));
+  size_t n = lz_compress(b->data, b->len, out);
+  if (n >= b->len) {
+    free(out);
+    return;
+  }
+  sb_bytes += n - b->cap;
+  free(b->data);
+  b->data = realloc(out, n);
+  b->len = b->cap = n;
+  b->compressed = 1;
+}
+
+// Appends a block's data to the spill file and releases it from memory.
+// Returns 0 if the file cannot be created or written.
+int sb_spill(SbBlock *b) {
+  if (sb_spill_fd == -1) {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/oolong-t-scrollback-XXXXXX",
+             dir && *dir ? dir : "/tmp");
+    sb_spill_fd = mkstemp(path);
+    if (sb_spill_fd == -1)
+      return 0;
+    unlink(path); // Disk space is reclaimed when we exit
+  }
+  if (pwrite(sb_spill_fd, b->data, b->len, sb_spill_size) != (ssize_t)b->len ||
+      pwrite(sb_spill_fd, b->bloom, SB_BLOOM_BYTES, sb_spill_size + b->len) !=
+          SB_BLOOM_BYTES)
+    return 0;
+  b->file_off = sb_spill_size;
+  sb_spill_size += b->len + SB_BLOOM_BYTES;
+  sb_bytes -= b->cap + SB_BLOOM_BYTES;
+  free(b->data);
+  free(b->bloom);
+  b->data = b->bloom = NULL;
+  b->cap = 0;
+  b->spilled = 1;
+  return 1;
+}
+
+// A spilled block's data. The file is mapped with room to grow and remapped
+// only when a block lies past the end of the mapping.
+const uint8_t *sb_spill_at(const SbBlock *b) {
+  size_t end = b->file_off + b->len + SB_BLOOM_BYTES;
+  if (end > sb_spill_map_len) {
+    if (sb_spill_map)
+      munmap((void *)sb_spill_map, sb_spill_map_len);
+    size_t len = sb_spill_map_len ? sb_spill_map_len : SB_SPILL_MAP_MIN;
+    while (len < end)
+      len *= 2;
+    sb_spill_map = mmap(NULL, len, PROT_READ, MAP_SHARED, sb_spill_fd, 0);
+    if (sb_spill_map == MAP_FAILED) {
+      perror("mmap scrollback");
+      exit(1);
+    }
+    sb_spill_map_len = len;
+  }
+  return sb_spill_map + b->file_off;
+}
+
+// Brings a block back into memory, uncompressed.
+void sb_block_load(SbBlock *b) {
+  if (b->spilled) {
+    const uint8_t *src = sb_spill_at(b);
+    b->data = malloc(b->len);
+    b->bloom = malloc(SB_BLOOM_BYTES);
+    memcpy(b->data, src, b->len);
+    memcpy(b->bloom, src + b->len, SB_BLOOM_BYTES);
+    b->cap = b->len;
+    sb_bytes += b->cap + SB_BLOOM_BYTES;
+    b->spilled = 0;
+  }
+  if (b->compressed) {
+    uint8_t *raw = malloc(b->raw_len);
+    lz_decompress(b->data, b->len, raw);
+    sb_bytes += b->raw_len - b->cap;
+    free(b->data);
+    b->data = raw;
+    b->len = b->cap = b->raw_len;
+    b->compressed = 0;
+  }
+  if (sb_cache_block == b)
+    sb_cache_block = NULL;
+}
+
+// Raw packed lines of a block, decompressing or copying out of the spill
+// file into *buf if needed.
+const uint8_t *sb_block_read(SbBlock *b, uint8_t **buf, size_t *cap) {
+  if (!b->compressed && !b->spilled)
+    return b->data;
+  if (*cap < b->raw_len) {
+    *cap = b->raw_len;
+    *buf = realloc(*buf, *cap);
+  }
+  const uint8_t *src = b->spilled ? sb_spill_at(b) : b->data;
+  if (b->compressed)
+    lz_decompress(src, b->len, *buf);
+  else
+    memcpy(*buf, src, b->len);
+  return *buf;
+}
+
+// Like sb_block_read, through the single-block read cache.
+const uint8_t *sb_block_raw(SbBlock *b) {
+  if (sb_cache_block == b)
+    return sb_cache_data;
+  const uint8_t *raw = sb_block_read(b, &sb_cache_data, &sb_cache_cap);
+  if (raw == sb_cache_data)
+    sb_cache_block = b;
+  return raw;
+}
+
+const uint8_t *sb_block_bloom(SbBlock *b) {
+  return b->spilled ? sb_spill_at(b) + b->len : b->bloom;
+}
+
+// Appends the newest block's offsets to its data once it is full.
+void sb_seal(SbBlock *b) {
+  size_t table = (b->lines + 1) * sizeof(uint32_t);
+  uint8_t *data = realloc(b->data, b->len + table);
+  memcpy(data + b->len, sb_offsets, table);
+  b->data = data;
+  b->len += table;
+  sb_bytes += b->len - b->cap;
+  b->cap = b->raw_len = b->len;
+}
+
+// Makes a sealed block the newest again after the one past it was popped.
+void sb_unseal(SbBlock *b) {
+  sb_block_load(b);
+  size_t table = (b->lines + 1) * sizeof(uint32_t);
+  memcpy(sb_offsets, b->data + b->len - table, table);
+  b->len = b->raw_len = sb_offsets[b->lines];
+}
+
+void sb_block_free(SbBlock *b) {
+  sb_bytes -= b->cap + (b->bloom ? SB_BLOOM_BYTES : 0);
+  if (sb_cache_block == b)
+    sb_cache_block = NULL;
+  free(b->data);
+  free(b->bloom);
+  free(b);
+}
+
+void sb_drop_oldest() {
+  SbBlock *b = sb_blocks[0];
+  sb_lines -= b->lines;
+  sb_dropped += b->lines;
+  if (b->spilled)
+    sb_spilled--;
+  sb_block_free(b);
+  memmove(sb_blocks, sb_blocks + 1, --sb_nblocks * sizeof(SbBlock *));
+  if (scroll_offset > sb_lines) {
+    scroll_offset = sb_lines;
+    mark_all_dirty();
+  }
+}
+
+void sb_clear() {
+  while (sb_nblocks)
+    sb_drop_oldest();
+  sb_dropped = 0;
+  scroll_offset = 0;
+  if (sb_spill_fd != -1) {
+    if (sb_spill_map)
+      munmap((void *)sb_spill_map, sb_spill_map_len);
+    sb_spill_map = NULL;
+    sb_spill_map_len = 0;
+    ftruncate(sb_spill_fd, 0);
+    sb_spill_size = 0;
+  }
+}
+
+int sb_same_pen(const SbRun *r, uint8_t attrs, const VTermColor *fg,
+                const VTermColor *bg) {
+  return r->attrs == attrs && r->fg[0] == fg->rgb.red &&
+         r->fg[1] == fg->rgb.green && r->fg[2] == fg->rgb.blue &&
+         r->bg[0] == bg->rgb.red && r->bg[1] == bg->rgb.green &&
+         r->bg[2] == bg->rgb.blue;
+}
+
+int sb_put_utf8(uint8_t *out, uint32_t c) {
+  if (c < 0x80) {
+    out[0] = c;
+    return 1;
+  }
+  if (c < 0x800) {
+    out[0] = 0xC0 | c >> 6;
+    out[1] = 0x80 | (c & 0x3F);
+    return 2;
+  }
+  if (c < 0x10000) {
+    out[0] = 0xE0 | c >> 12;
+    out[1] = 0x80 | (c >> 6 & 0x3F);
+    out[2] = 0x80 | (c & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | c >> 18;
+  out[1] = 0x80 | (c >> 12 & 0x3F);
+  out[2] = 0x80 | (c >> 6 & 0x3F);
+  out[3] = 0x80 | (c & 0x3F);
+  return 4;
+}
+
+uint32_t sb_get_utf8(const uint8_t **p) {
+  const uint8_t *s = *p;
+  uint32_t c;
+  if (s[0] < 0x80) {
+    c = s[0];
+    *p += 1;
+  } else if (s[0] < 0xE0) {
+    c = (s[0] & 0x1F) << 6 | (s[1] & 0x3F);
+    *p += 2;
+  } else if (s[0] < 0xF0) {
+    c = (s[0] & 0x0F) << 12 | (s[1] & 0x3F) << 6 | (s[2] & 0x3F);
+    *p += 3;
+  } else {
+    c = (s[0] & 0x07) << 18 | (s[1] & 0x3F) << 12 | (s[2] & 0x3F) << 6 |
+        (s[3] & 0x3F);
+    *p += 4;
+  }
+  return c;
+}
+
+int utf8_length(uint8_t lead) {
+  return lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+}
+
+char ascii_lower(char c) { return c >= 'A' && c <= 'Z' ? c + 32 : c; }
+
+// The text of a packed line as UTF-8, with the column of each byte if cols
+// is given. Returns its length; text needs room for the line's text bytes.
+int sb_line_text(const uint8_t *in, char *text, uint16_t *cols) {
+  SbLineHeader hdr;
+  memcpy(&hdr, in, sizeof(hdr));
+  const uint8_t *p = in + sizeof(hdr) + hdr.runs * sizeof(SbRun);
+  const uint8_t *end = p + hdr.text;
+  int n = 0, col = -1;
+  while (p < end) {
+    if (*p == SB_WIDE_CONT) {
+      col++;
+      p++;
+      continue;
+    }
+    if (*p == SB_COMBINING)
+      p++;
+    else
+      col++;
+    for (int len = utf8_length(*p); len > 0; len--) {
+      if (cols)
+        cols[n] = col;
+      text[n++] = *p++;
+    }
+  }
+  return n;
+}
+
+// Trigrams are case-folded so one filter serves every search. Each sets two
+// bits, from the top and the middle of one multiplicative hash.
+void trigram_bits(const char *s, uint32_t *a, uint32_t *b) {
+  uint32_t t = (uint8_t)ascii_lower(s[0]) | (uint8_t)ascii_lower(s[1]) << 8 |
+               (uint8_t)ascii_lower(s[2]) << 16;
+  uint32_t h = t * 2654435761u;
+  *a = h >> (32 - SB_BLOOM_LOG2);
+  *b = (h >> 4) & (SB_BLOOM_BITS - 1);
+}
+
+void bloom_add(uint8_t *bloom, const char *text, int n) {
+  for (int i = 0; i + 3 <= n; i++) {
+    uint32_t a, b;
+    trigram_bits(text + i, &a, &b);
+    bloom[a >> 3] |= 1 << (a & 7);
+    bloom[b >> 3] |= 1 << (b & 7);
+  }
+}
+
+// Returns 0 if no line of the block can contain text, 1 if one might.
+int bloom_may_contain(const uint8_t *bloom, const char *text, int n) {
+  for (int i = 0; i + 3 <= n; i++) {
+    uint32_t a, b;
+    trigram_bits(text + i, &a, &b);
+    if (!(bloom[a >> 3] & 1 << (a & 7)) || !(bloom[b >> 3] & 1 << (b & 7)))
+      return 0;
+  }
+  return 1;
+}
+
+// Packs a line into out, which must hold sb_pack_bound(cols) bytes.
+size_t sb_pack_bound(int cols) {
+  return sizeof(SbLineHeader) + cols * sizeof(SbRun) +
+         cols * VTERM_MAX_CHARS_PER_CELL * 5;
+}
+
+// Lines start at arbitrary byte offsets, so headers and runs are copied
+// in and out rather than accessed in place.
+size_t sb_pack_line(int cols, const VTermScreenCell *cells, uint8_t *out) {
+  static SbRun *runs = NULL;
+  static int runs_cap = 0;
+  if (runs_cap < cols) {
+    runs_cap = cols;
+    runs = realloc(runs, runs_cap * sizeof(SbRun));
+  }
+  VTermState *state = vterm_obtain_state(vterm);
+  VTermColor default_fg, default_bg;
+  vterm_state_get_default_colors(state, &default_fg, &default_bg);
+
+  // Trailing erased cells on the default background come back on unpack
+  while (cols > 0 && cells[cols - 1].chars[0] == 0 &&
+         !cells[cols - 1].attrs.reverse) {
+    VTermColor bg = cells[cols - 1].bg;
+    vterm_state_convert_color_to_rgb(state, &bg);
+    if (bg.rgb.red != default_bg.rgb.red ||
+        bg.rgb.green != default_bg.rgb.green ||
+        bg.rgb.blue != default_bg.rgb.blue)
+      break;
+    cols--;
+  }
+
+  int nruns = 0;
+  for (int col = 0; col < cols; col++) {
+    const VTermScreenCell *cell = &cells[col];
+    VTermColor fg = cell->fg, bg = cell->bg;
+    vterm_state_convert_color_to_rgb(state, &fg);
+    vterm_state_convert_color_to_rgb(state, &bg);
+    uint8_t attrs = cell_attr_bits(cell);
+    if (nruns && sb_same_pen(&runs[nruns - 1], attrs, &fg, &bg)) {
+      runs[nruns - 1].count++;
+    } else {
+      runs[nruns++] = (SbRun){1,
+                              attrs,
+                              {fg.rgb.red, fg.rgb.green, fg.rgb.blue},
+                              {bg.rgb.red, bg.rgb.green, bg.rgb.blue}};
+    }
+  }
+
+  uint8_t *text = out + sizeof(SbLineHeader) + nruns * sizeof(SbRun);
+  uint8_t *p = text;
+  for (int col = 0; col < cols; col++) {
+    const uint32_t *chars = cells[col].chars;
+    if (chars[0] == (uint32_t)-1) {
+      *p++ = SB_WIDE_CONT;
+      continue;
+    }
+    p += sb_put_utf8(p, chars[0] ? chars[0] : ' ');
+    for (int i = 1; i < VTERM_MAX_CHARS_PER_CELL && chars[0] && chars[i]; i++) {
+      *p++ = SB_COMBINING;
+      p += sb_put_utf8(p, chars[i]);
+    }
+  }
+
+  SbLineHeader hdr = {cols, nruns, p - text};
+  memcpy(out, &hdr, sizeof(hdr));
+  memcpy(out + sizeof(hdr), runs, nruns * sizeof(SbRun));
+  return p - out;
+}
+
+void sb_unpack_line(const uint8_t *in, int cols, VTermScreenCell *cells) {
+  VTermState *state = vterm_obtain_state(vterm);
+  VTermColor default_fg, default_bg;
+  vterm_state_get_default_colors(state, &default_fg, &default_bg);
+  vterm_state_convert_color_to_rgb(state, &default_fg);
+  vterm_state_convert_color_to_rgb(state, &default_bg);
+
+  SbLineHeader hdr;
+  memcpy(&hdr, in, sizeof(hdr));
+  const uint8_t *runs = in + sizeof(hdr);
+  const uint8_t *p = runs + hdr.runs * sizeof(SbRun);
+  const uint8_t *end = p + hdr.text;
+
+  SbRun r = {0};
+  int left = 0;
+  int col = 0;
+  while (p < end) {
+    if (*p == SB_COMBINING) {
+      p++;
+      uint32_t c = sb_get_utf8(&p);
+      if (col == 0 || col > cols)
+        continue;
+      uint32_t *chars = cells[col - 1].chars;
+      for (int i = 1; i < VTERM_MAX_CHARS_PER_CELL; i++) {
+        if (!chars[i]) {
+          chars[i] = c;
+          if (i + 1 < VTERM_MAX_CHARS_PER_CELL)
+            chars[i + 1] = 0;
+          break;
+        }
+      }
+      continue;
+    }
+    uint32_t c = *p == SB_WIDE_CONT ? (p++, (uint32_t)-1) : sb_get_utf8(&p);
+    if (!left) {
+      memcpy(&r, runs, sizeof(r));
+      runs += sizeof(r);
+      left = r.count;
+    }
+    left--;
+    if (col >= cols) {
+      col++;
+      continue;
+    }
+    VTermScreenCell *cell = &cells[col++];
+    memset(cell, 0, sizeof(*cell));
+    cell->chars[0] = c;
+    cell->width = 1;
+    cell->attrs.bold = !!(r.attrs & SB_BOLD);
+    cell->attrs.underline = !!(r.attrs & SB_UNDERLINE);
+    cell->attrs.italic = !!(r.attrs & SB_ITALIC);
+    cell->attrs.reverse = !!(r.attrs & SB_REVERSE);
+    cell->attrs.strike = !!(r.attrs & SB_STRIKE);
+    cell->attrs.blink = !!(r.attrs & SB_BLINK);
+    cell->attrs.conceal = !!(r.attrs & SB_CONCEAL);
+    vterm_color_rgb(&cell->fg, r.fg[0], r.fg[1], r.fg[2]);
+    vterm_color_rgb(&cell->bg, r.bg[0], r.bg[1], r.bg[2]);
+    if (c == (uint32_t)-1 && col >= 2)
+      cells[col - 2].width = 2;
+  }
+
+  for (; col < cols; col++) {
+    memset(&cells[col], 0, sizeof(cells[col]));
+    cells[col].width = 1;
+    cells[col].fg = default_fg;
+    cells[col].bg = default_bg;
+  }
+}
+
+void sb_push(int cols, const VTermScreenCell *cells) {
+  static uint8_t *packed = NULL;
+  static size_t packed_cap = 0;
+  if (packed_cap < sb_pack_bound(cols)) {
+    packed_cap = sb_pack_bound(cols);
+    packed = realloc(packed, packed_cap);
+  }
+  size_t n = sb_pack_line(cols, cells, packed);
+
+  SbBlock *b = sb_nblocks ? sb_blocks[sb_nblocks - 1] : NULL;
+  if (!b || b->lines == SB_BLOCK_LINES) {
+    if (b) {
+      // Seal the full block, and compress the one leaving the hot set
+      sb_seal(b);
+      if (sb_nblocks > SB_HOT_BLOCKS)
+        sb_block_compress(sb_blocks[sb_nblocks - 1 - SB_HOT_BLOCKS]);
+    }
+    if (sb_nblocks == sb_blocks_cap) {
+      sb_blocks_cap = sb_blocks_cap ? sb_blocks_cap * 2 : 64;
+      sb_blocks = realloc(sb_blocks, sb_blocks_cap * sizeof(SbBlock *));
+    }
+    b = calloc(1, sizeof(SbBlock));
+    b->bloom = calloc(1, SB_BLOOM_BYTES);
+    sb_bytes += SB_BLOOM_BYTES;
+    sb_blocks[sb_nblocks++] = b;
+    sb_offsets[0] = 0;
+  }
+
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (b->len + n > cap)
+      cap *= 2;
+    b->data = realloc(b->data, cap);
+    sb_bytes += cap - b->cap;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, packed, n);
+  static char *text = NULL;
+  static size_t text_cap = 0;
+  if (text_cap < n) {
+    text_cap = n;
+    text = realloc(text, text_cap);
+  }
+  bloom_add(b->bloom, text, sb_line_text(packed, text, NULL));
+  b->len += n;
+  sb_offsets[++b->lines] = b->len;
+  b->raw_len = b->len;
+  sb_lines++;
+
+  while (sb_bytes > SCROLLBACK_BUDGET && sb_spilled < sb_nblocks - 1) {
+    SbBlock *old = sb_blocks[sb_spilled];
+    sb_block_compress(old); // Only if it was still in the hot set
+    if (sb_spill_failed || !sb_spill(old)) {
+      sb_spill_failed = 1;
+      sb_drop_oldest();
+      continue;
+    }
+    sb_spilled++;
+  }
+}
+
+// Removes the newest line into cells. Returns 0 if there is none.
+int sb_pop(int cols, VTermScreenCell *cells) {
+  if (!sb_lines)
+    return 0;
+  SbBlock *b = sb_blocks[sb_nblocks - 1];
+  b->lines--;
+  sb_unpack_line(b->data + sb_offsets[b->lines], cols, cells);
+  b->len = b->raw_len = sb_offsets[b->lines];
+  sb_lines--;
+  if (!b->lines) {
+    sb_block_free(b);
+    if (--sb_nblocks) {
+      SbBlock *prev = sb_blocks[sb_nblocks - 1];
+      if (prev->spilled)
+        sb_spilled--;
+      sb_unseal(prev);
+    }
+  }
+  return 1;
+}
+
+// Start of a line within a block's raw data. The newest block keeps its
+// offsets in sb_offsets, sealed blocks after their lines.
+uint32_t sb_line_offset(int block, const uint8_t *raw, int line) {
+  if (block == sb_nblocks - 1)
+    return sb_offsets[line];
+  SbBlock *b = sb_blocks[block];
+  uint32_t off;
+  memcpy(&off, raw + b->raw_len - (b->lines + 1 - line) * sizeof(uint32_t),
+         sizeof(off));
+  return off;
+}
+
+// Unpacks line index of the history, 0 being the oldest held.
+void sb_get_line(long index, int cols, VTermScreenCell *cells) {
+  int block = index / SB_BLOCK_LINES;
+  const uint8_t *raw = sb_block_raw(sb_blocks[block]);
+  int line = index % SB_BLOCK_LINES;
+  sb_unpack_line(raw + sb_line_offset(block, raw, line), cols, cells);
+}
+
+// The view shows the last scroll_offset lines of history above the top
+// rows of the screen.
+void view_get_row(int row, int cols, VTermScreenCell *cells) {
+  if (row < scroll_offset) {
+    SDL_LockMutex(sb_lock);
+    sb_get_line(sb_lines - scroll_offset + row, cols, cells);
+    SDL_UnlockMutex(sb_lock);
+    return;
+  }
+  for (int col = 0; col < cols; col++) {
+    VTermPos pos = {row - scroll_offset, col};
+    vterm_screen_get_cell(vterm_screen, pos, &cells[col]);
+  }
+}
+
+void view_scroll(int lines) {
+  int offset = scroll_offset + lines;
+  if (offset > sb_lines)
+    offset = sb_lines;
+  if (offset < 0)
+    offset = 0;
+  if (offset == scroll_offset)
+    return;
+  // Rows already on screen just move down (or up), so rotate the frame;
+  // every row is rechecked but only the newly shown ones differ
+  frame_rotate(scroll_offset - offset);
+  scroll_offset = offset;
+  mark_all_dirty();
+}
+
+void view_reset() { view_scroll(-scroll_offset); }
+
+// --- Atlas Rebuild ---
+// After a zoom the coverage atlas is rasterized again at the new size by a
+// pool of worker threads, glyphs on screen first and then the rest of the
+// resident set, into a bitmap laid out like the final atlas. Workers claim
+// slots from a shared counter and each slot is its own region of the bitmap,
+// so they never write the same pixels, and expand their slots to the texture
+// format as they go. The grid meanwhile draws the old atlas scaled. Once the
+// workers are done the expanded rows go up into a new texture
+// ATLAS_UPLOAD_ROWS per main loop pass, and the texture is swapped in when
+// complete, so the UI thread neither rasterizes nor uploads in one go.
+typedef struct {
+  int glyph, style;
+} GlyphKey;
+
+typedef struct {
+  FontMetrics metrics;
+  GlyphKey *keys; // In slot order
+  Glyph *boxes;   // Rasterized box per key
+  int count;
+  unsigned char *bitmap; // Becomes atlas_bitmap
+  Uint32 *pixels;        // bitmap's used rows as the texture holds them
+  int rows;
+  SDL_Texture *texture; // Becomes font_texture once rows are uploaded
+  int uploaded;
+  atomic_int next; // Next key to claim
+  atomic_int running;    // Workers yet to finish
+  atomic_int cancel;
+  atomic_int done;
+  SDL_Thread *threads[ATLAS_MAX_THREADS];
+  int nthreads;
+} AtlasRebuild;
+
+AtlasRebuild *rebuild = NULL;
+Uint32 rebuild_event = 0;
+int atlas_threads = ATLAS_THREADS;
+
+int glyph_key_cmp(const void *a, const void *b) {
+  const GlyphKey *x = a, *y = b;
+  return x->glyph != y->glyph ? x->glyph - y->glyph : x->style - y->style;
+}
+
+// Most recently used slots first
+int slot_recency_cmp(const void *a, const void *b) {
+  Uint32 x = glyphs[*(const int *)a].last_used;
+  Uint32 y = glyphs[*(const int *)b].last_used;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void rebuild_signal_done(AtlasRebuild *r) {
+  atomic_store(&r->done, 1);
+  SDL_Event ev = {.type = rebuild_event};
+  SDL_PushEvent(&ev);
+}
+
+int rebuild_worker(void *arg) {
+  AtlasRebuild *r = arg;
+  GlyphScratch scratch = {0};
+  int w = slot_width(&r->metrics), h = r->metrics.cell_height;
+  for (int i; (i = atomic_fetch_add(&r->next, 1)) < r->count &&
+              !atomic_load(&r->cancel);) {
+    int ax, ay;
+    slot_origin(i, w, h, &ax, &ay);
+    glyph_render(&r->metrics, r->keys[i].glyph, r->keys[i].style,
+                 r->bitmap + ay * ATLAS_WIDTH + ax, ATLAS_WIDTH, &r->boxes[i],
+                 &scratch);
+    // The slot with its padding, clipped like glyph_upload_slot
+    int pw = ax + w + 1 > ATLAS_WIDTH ? ATLAS_WIDTH - ax : w + 1;
+    int ph = ay + h + 1 > r->rows ? r->rows - ay : h + 1;
+    for (int y = ay; y < ay + ph; y++)
+      expand_coverage(r->bitmap + y * ATLAS_WIDTH + ax,
+                      r->pixels + y * ATLAS_WIDTH + ax, pw);
+  }
+  free(scratch.data);
+  if (atomic_fetch_sub(&r->running, 1) == 1)
+    rebuild_signal_done(r);
+  return 0;
+}
+
+void atlas_rebuild_join(AtlasRebuild *r) {
+  for (int i = 0; i < r->nthreads; i++)
+    SDL_WaitThread(r->threads[i], NULL);
+  r->nthreads = 0;
+}
+
+void atlas_rebuild_free(AtlasRebuild *r) {
+  if (r->texture)
+    SDL_DestroyTexture(r->texture);
+  free(r->keys);
+  free(r->boxes);
+  free(r->bitmap);
+  free(r->pixels);
+  free(r);
+}
+
+void atlas_rebuild_cancel() {
+  if (!rebuild)
+    return;
+  atomic_store(&rebuild->cancel, 1);
+  atlas_rebuild_join(rebuild);
+  atlas_rebuild_free(rebuild);
+  rebuild = NULL;
+}
+
+// Starts rasterizing the atlas for font_size, replacing any build still
+// running.
+void atlas_rebuild_start() {
+  atlas_rebuild_cancel();
+  if (!rebuild_event)
+    rebuild_event = SDL_RegisterEvents(1);
+  AtlasRebuild *r = calloc(1, sizeof(AtlasRebuild));
+  r->metrics = font_metrics(font_size);
+  int cap = slot_count(slot_width(&r->metrics), r->metrics.cell_height);
+
+  // What is on screen, sorted and deduplicated
+  size_t cells = (size_t)frame_rows * frame_cols;
+  GlyphKey *screen = malloc((cells + 1) * sizeof(GlyphKey));
+  int nscreen = 0;
+  for (size_t i = 0; i < cells; i++) {
+    uint32_t code = shadow[i].code;
+    if (!shadow_valid[i / frame_cols] || code <= ' ' || code == (uint32_t)-1)
+      continue;
+    int gi = glyph_index(code);
+    if (gi)
+      screen[nscreen++] = (GlyphKey){
+          gi, shadow[i].attrs & SB_BOLD ? STYLE_BOLD : STYLE_REGULAR};
+  }
+  qsort(screen, nscreen, sizeof(GlyphKey), glyph_key_cmp);
+  int unique = 0;
+  for (int i = 0; i < nscreen; i++)
+    if (!unique || glyph_key_cmp(&screen[unique - 1], &screen[i]))
+      screen[unique++] = screen[i];
+  nscreen = unique;
+
+  // Then the rest of the resident set, most recently used first
+  int *order = malloc((glyph_slots_used + 1) * sizeof(int));
+  for (int i = 0; i < glyph_slots_used; i++)
+    order[i] = i;
+  qsort(order, glyph_slots_used, sizeof(int), slot_recency_cmp);
+  r->keys = malloc((nscreen + glyph_slots_used + 1) * sizeof(GlyphKey));
+  memcpy(r->keys, screen, nscreen * sizeof(GlyphKey));
+  r->count = nscreen;
+  for (int i = 0; i < glyph_slots_used; i++) {
+    Glyph *g = &glyphs[order[i]];
+    GlyphKey key = {g->glyph, g->style};
+    if (g->glyph >= 0 &&
+        !bsearch(&key, screen, nscreen, sizeof(GlyphKey), glyph_key_cmp))
+      r->keys[r->count++] = key;
+  }
+  if (r->count > cap)
+    r->count = cap;
+  free(order);
+  free(screen);
+
+  r->boxes = calloc(r->count + 1, sizeof(Glyph));
+  r->bitmap = calloc(1, ATLAS_WIDTH * ATLAS_HEIGHT);
+  if (r->count) {
+    int w = slot_width(&r->metrics), h = r->metrics.cell_height, ax, ay;
+    slot_origin(r->count - 1, w, h, &ax, &ay);
+    r->rows = ay + h + 1 < ATLAS_HEIGHT ? ay + h + 1 : ATLAS_HEIGHT;
+  }
+  r->pixels = calloc((size_t)ATLAS_WIDTH * r->rows + 1, sizeof(Uint32));
+  int n = atlas_threads > 0 ? atlas_threads : SDL_GetCPUCount();
+  n = n < 1 ? 1 : n > ATLAS_MAX_THREADS ? ATLAS_MAX_THREADS : n;
+  atomic_store(&r->running, n);
+  for (int i = 0; i < n; i++) {
+    r->threads[i] = SDL_CreateThread(rebuild_worker, "atlas", r);
+    if (!r->threads[i]) {
+      // Fewer workers: those running pick up the rest, or with none this
+      // thread does it all
+      if (i == 0) {
+        atomic_store(&r->running, 1);
+        rebuild_worker(r);
+      } else if (atomic_fetch_sub(&r->running, n - i) == n - i) {
+        rebuild_signal_done(r);
+      }
+      break;
+    }
+    r->nthreads++;
+  }
+  rebuild = r;
+}
+
+// Sends the next rows of a finished build to its texture, and once all are
+// there makes it the atlas. Returns 1 when the atlas was swapped.
+int atlas_rebuild_finish() {
+  if (!rebuild || !atomic_load(&rebuild->done))
+    return 0;
+  AtlasRebuild *r = rebuild;
+  if (!r->texture) {
+    atlas_rebuild_join(r);
+    r->texture = atlas_create_texture();
+  }
+  if (r->uploaded < r->rows) {
+    int n = r->rows - r->uploaded;
+    n = n < ATLAS_UPLOAD_ROWS ? n : ATLAS_UPLOAD_ROWS;
+    SDL_Rect rect = {0, r->uploaded, ATLAS_WIDTH, n};
+    SDL_UpdateTexture(r->texture, &rect,
+                      r->pixels + (size_t)r->uploaded * ATLAS_WIDTH,
+                      ATLAS_WIDTH * sizeof(Uint32));
+    r->uploaded += n;
+    if (r->uploaded < r->rows)
+      return 0;
+  }
+  rebuild = NULL;
+
+  if (atlas_bitmap_mapped)
+    munmap(atlas_bitmap, ATLAS_WIDTH * ATLAS_HEIGHT);
+  else
+    free(atlas_bitmap);
+  atlas_bitmap = r->bitmap;
+  atlas_bitmap_mapped = 0;
+  r->bitmap = NULL;
+  atlas_metrics = r->metrics;
+  glyph_cache_init();
+  for (int i = 0; i < r->count; i++) {
+    Glyph *g = glyph_install(i, r->keys[i].glyph, r->keys[i].style);
+    g->x0 = r->boxes[i].x0;
+    g->y0 = r->boxes[i].y0;
+    g->x1 = r->boxes[i].x1;
+    g->y1 = r->boxes[i].y1;
+  }
+  glyph_slots_used = r->count;
+  atlas_cache_stale = 1;
+
+  SDL_DestroyTexture(font_texture);
+  font_texture = r->texture;
+  r->texture = NULL;
+  atlas_rebuild_free(r);
+  shadow_invalidate_glyphs();
+  return 1;
+}
+
+// --- Geometry Batching ---
+// Quads are accumulated per frame and submitted with one SDL_RenderGeometry
+// call per batch, with colors carried in the vertices.
+typedef struct {
+  SDL_Vertex *verts;
+  int *indices;
+  int quads;
+  int cap;
+} QuadBatch;
+
+QuadBatch bg_batch;    // Untextured row clears and cell backgrounds
+QuadBatch glyph_batch; // Glyphs sampled from font_texture
+
+void batch_reserve(QuadBatch *b, int quads) {
+  if (quads <= b->cap)
+    return;
+  int cap = b->cap ? b->cap : 1024;
+  while (cap < quads)
+    cap *= 2;
+  b->verts = realloc(b->verts, cap * 4 * sizeof(SDL_Vertex));
+  b->indices = realloc(b->indices, cap * 6 * sizeof(int));
+  // The index pattern never changes, so it is only written on growth
+  for (int i = b->cap; i < cap; i++) {
+    int *idx = &b->indices[i * 6];
+    idx[0] = i * 4;
+    idx[1] = i * 4 + 1;
+    idx[2] = i * 4 + 2;
+    idx[3] = i * 4;
+    idx[4] = i * 4 + 2;
+    idx[5] = i * 4 + 3;
+  }
+  b->cap = cap;
+}
+
+void batch_quad(QuadBatch *b, float x0, float y0, float x1, float y1, float s0,
+                float t0, float s1, float t1, SDL_Color color) {
+  batch_reserve(b, b->quads + 1);
+  SDL_Vertex *v = &b->verts[b->quads * 4];
+  v[0] = (SDL_Vertex){{x0, y0}, color, {s0, t0}};
+  v[1] = (SDL_Vertex){{x1, y0}, color, {s1, t0}};
+  v[2] = (SDL_Vertex){{x1, y1}, color, {s1, t1}};
+  v[3] = (SDL_Vertex){{x0, y1}, color, {s0, t1}};
+  b->quads++;
+}
+
+// Queues a glyph for the cell whose top-left corner is (x, y) and keeps its
+// slot from being evicted this frame.
+void batch_glyph(QuadBatch *b, const GlyphRecord *r, float x, float y,
+                 SDL_Color color) {
+  glyphs[r->slot].last_used = glyph_frame;
+  batch_quad(b, x + r->x0, y + r->y0, x + r->x1, y + r->y1, r->s0, r->t0,
+             r->s1, r->t1, color);
+}
+
+void batch_rect(QuadBatch *b, float x, float y, float w, float h,
+                SDL_Color color) {
+  batch_quad(b, x, y, x + w, y + h, 0, 0, 0, 0, color);
+}
+
+void batch_flush(QuadBatch *b, SDL_Texture *texture) {
+  if (b->quads)
+    SDL_RenderGeometry(renderer, texture, b->verts, b->quads * 4, b->indices,
+                       b->quads * 6);
+  b->quads = 0;
+}
+
+// --- Background Spans ---
+// Cell backgrounds are merged into rectangles before batching: horizontal runs
+// of one color within a row, then identical runs on consecutive rows into one
+// taller rect. Positions are in cells.
+typedef struct {
+  int col0, col1;
+  int row0, row1;
+  SDL_Color color;
+} BgSpan;
+
+typedef struct {
+  BgSpan *items;
+  int len;
+  int cap;
+} BgSpanList;
+
+BgSpanList open_spans; // Spans that may still grow into the next row
+BgSpanList next_spans;
+BgSpanList done_spans;  // Closed non-default spans
+BgSpanList clear_spans; // Closed default-color row clears, drawn first
+int open_spans_row = -1; // Last row that contributed to open_spans
+
+void span_push(BgSpanList *l, BgSpan span) {
+  if (l->len == l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 256;
+    l->items = realloc(l->items, l->cap * sizeof(BgSpan));
+  }
+  l->items[l->len++] = span;
+}
+
+int same_color(SDL_Color a, SDL_Color b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+// Default-color spans are the full-width row clears; they go to their own list
+// so they are drawn underneath every run.
+void span_close(BgSpan span, SDL_Color clear_color) {
+  int full = span.col0 == 0 && span.col1 == frame_cols;
+  span_push(full && same_color(span.color, clear_color) ? &clear_spans
+                                                         : &done_spans,
+            span);
+}
+
+void spans_close_all(SDL_Color clear_color) {
+  for (int i = 0; i < open_spans.len; i++)
+    span_close(open_spans.items[i], clear_color);
+  open_spans.len = 0;
+  open_spans_row = -1;
+}
+
+// Adds one row's runs (sorted by column). A run extends an open span from the
+// row above when both edges and the color match; everything else closes.
+void spans_add_row(int row, BgSpan *runs, int n, SDL_Color clear_color) {
+  if (open_spans_row != row - 1)
+    spans_close_all(clear_color);
+
+  next_spans.len = 0;
+  int p = 0;
+  for (int i = 0; i < n; i++) {
+    BgSpan run = runs[i];
+    while (p < open_spans.len && open_spans.items[p].col0 < run.col0)
+      span_close(open_spans.items[p++], clear_color);
+    if (p < open_spans.len && open_spans.items[p].col0 == run.col0 &&
+        open_spans.items[p].col1 == run.col1 &&
+        same_color(open_spans.items[p].color, run.color)) {
+      run.row0 = open_spans.items[p++].row0;
+    }
+    span_push(&next_spans, run);
+  }
+  while (p < open_spans.len)
+    span_close(open_spans.items[p++], clear_color);
+
+  BgSpanList tmp = open_spans;
+  open_spans = next_spans;
+  next_spans = tmp;
+  open_spans_row = row;
+}
+
+// Moves every closed span into bg_batch, clears first.
+void spans_emit(SDL_Color clear_color) {
+  spans_close_all(clear_color);
+  BgSpanList *lists[] = {&clear_spans, &done_spans};
+  for (int l = 0; l < 2; l++) {
+    for (int i = 0; i < lists[l]->len; i++) {
+      BgSpan *sp = &lists[l]->items[i];
+      batch_rect(&bg_batch, sp->col0 * cell_width, sp->row0 * cell_height,
+                 (sp->col1 - sp->col0) * cell_width,
+                 (sp->row1 - sp->row0) * cell_height, sp->color);
+    }
+    frame_stats.bg_rects += lists[l]->len;
+    lists[l]->len = 0;
+  }
+}
+
+// --- Cursor ---
+// The cursor is an overlay drawn over frame_texture at present time, so a
+// blink never touches the grid. It only blinks while the window is focused
+// and the user has typed recently.
+int window_focused = 1;
+int cursor_visible = 1; // DECTCEM, from libvterm
+int cursor_blink = 1;   // Application-requested blinking
+Uint32 cursor_epoch;    // Blink phase origin, reset on input
+int cursor_shown_lit = -1; // What the last present drew
+
+int cursor_blinking(Uint32 now) {
+  return window_focused && cursor_visible && cursor_blink &&
+         now - cursor_epoch < CURSOR_IDLE_MS;
+}
+
+int cursor_lit(Uint32 now) {
+  if (!cursor_blinking(now))
+    return 1;
+  return ((now - cursor_epoch) / CURSOR_BLINK_MS) % 2 == 0;
+}
+
+// Milliseconds until the cursor next changes appearance, or -1 if steady.
+int cursor_next_change(Uint32 now) {
+  if (!cursor_blinking(now))
+    return -1;
+  Uint32 elapsed = now - cursor_epoch;
+  Uint32 toggle = CURSOR_BLINK_MS - elapsed % CURSOR_BLINK_MS;
+  Uint32 idle = CURSOR_IDLE_MS - elapsed;
+  return toggle < idle ? toggle : idle;
+}
+
+void cursor_reset_blink() {
+  cursor_epoch = SDL_GetTicks();
+  if (cursor_shown_lit != 1)
+    dirty = 1;
+}
+
+void draw_cursor(VTermState *state) {
+  cursor_shown_lit = cursor_lit(SDL_GetTicks());
+  if (!cursor_visible || !cursor_shown_lit)
+    return;
+
+  int rows, cols;
+  vterm_get_size(vterm, &rows, &cols);
+  VTermPos cursor_pos;
+  vterm_state_get_cursorpos(state, &cursor_pos);
+  int row = cursor_pos.row + scroll_offset;
+  if (row >= rows)
+    return; // Scrolled out of view
+  SDL_Rect cursor_rect = {cursor_pos.col * cell_width, row * cell_height,
+                          cell_width, cell_height};
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+  SDL_SetRenderDrawColor(renderer, 255, 255, 255, 128);
+  if (window_focused)
+    SDL_RenderFillRect(renderer, &cursor_rect);
+  else
+    SDL_RenderDrawRect(renderer, &cursor_rect);
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+}
+
+// --- Search ---
+// Ctrl+Shift+F searches the screen and the whole scrollback as the query is
+// typed. A worker walks from the newest line to the oldest, skipping blocks
+// whose bloom filter rules the query out, and appends matches as it goes;
+// they are highlighted at present time like the cursor. Matches are kept by
+// absolute line so they stay put while history grows.
+#define SEARCH_MAX_MATCHES 100000
+#define SEARCH_QUERY_MAX 256
+#define SEARCH_BATCH 4096 // Matches the worker collects per search_add
+
+typedef struct {
+  long line; // Absolute line, see sb_dropped
+  int col0, col1;
+} SearchMatch;
+
+typedef struct {
+  char query[SEARCH_QUERY_MAX];
+  int regex;
+  int icase;
+  regex_t re;
+  char literal[SEARCH_QUERY_MAX]; // Lowercase text every match contains
+  long base;                      // Absolute line of screen row 0
+  int rows;
+  uint8_t *screen;         // The screen, packed like scrollback lines
+  size_t *screen_offsets;
+} SearchJob;
+
+int search_open = 0;
+int search_regex = 0;
+char search_query[SEARCH_QUERY_MAX];
+int search_error = 0; // The query does not compile
+SDL_Thread *search_thread = NULL;
+atomic_int search_cancel;
+atomic_int search_done;
+atomic_int search_wakeup_pending;
+Uint32 search_event;
+SDL_mutex *search_lock; // Guards the match list
+SearchMatch *search_matches = NULL; // Newest line first
+int search_count = 0;
+int search_cap = 0;
+int search_selected = -1;
+
+void search_init() {
+  search_lock = SDL_CreateMutex();
+  search_event = SDL_RegisterEvents(1);
+}
+
+// Longest run of characters every match of an extended regex contains, for
+// the bloom filter. Groups are skipped and alternation gives nothing.
+void regex_literal(const char *re, char *out) {
+  char run[SEARCH_QUERY_MAX];
+  int n = 0, best = 0, depth = 0;
+  out[0] = 0;
+  if (strchr(re, '|'))
+    return;
+  for (const char *p = re;; p++) {
+    int c = -1; // The plain character at p, if it is one
+    if (!*p) {
+      // Flush the last run below
+    } else if (*p == '\\') {
+      p++;
+      if (*p && !isalnum((unsigned char)*p))
+        c = *p;
+      else if (!*p)
+        p--;
+    } else if (*p == '*' || *p == '?' || *p == '{') {
+      n -= n > 0; // The quantified character is optional
+      if (*p == '{')
+        while (p[1] && *p != '}')
+          p++;
+    } else if (*p == '[') {
+      p += p[1] == '^';
+      p += p[1] == ']';
+      while (p[1] && p[1] != ']')
+        p++;
+      p += p[1] != 0;
+    } else if (*p == '(' || *p == ')') {
+      depth += *p == '(' ? 1 : -1;
+    } else if (!strchr(".+^$", *p)) {
+      c = *p;
+    }
+    if (c >= 0 && depth == 0) {
+      run[n++] = ascii_lower(c);
+      continue;
+    }
+    if (n > best) {
+      memcpy(out, run, n);
+      out[n] = 0;
+      best = n;
+    }
+    n = 0;
+    if (!*p)
+      break;
+  }
+}
+
+void search_add(SearchMatch *found, int n) {
+  SDL_LockMutex(search_lock);
+  if (search_count + n > SEARCH_MAX_MATCHES)
+    n = SEARCH_MAX_MATCHES - search_count;
+  if (search_count + n > search_cap) {
+    search_cap = search_cap ? search_cap * 2 : 256;
+    while (search_count + n > search_cap)
+      search_cap *= 2;
+    search_matches = realloc(search_matches, search_cap * sizeof(SearchMatch));
+  }
+  memcpy(search_matches + search_count, found, n * sizeof(SearchMatch));
+  search_count += n;
+  SDL_UnlockMutex(search_lock);
+  if (n && !atomic_exchange(&search_wakeup_pending, 1)) {
+    SDL_Event ev = {.type = search_event};
+    SDL_PushEvent(&ev);
+  }
+}
+
+// Appends the matches of one packed line to found, which holds
+// SEARCH_BATCH; a full batch is handed to search_add first. Returns the new
+// count.
+int search_line(SearchJob *job, const uint8_t *packed, long line,
+                SearchMatch *found, int n) {
+  static char text[1 << 16];
+  static char folded[1 << 16];
+  static uint16_t cols[1 << 16];
+  int len = sb_line_text(packed, text, cols);
+  text[len] = 0;
+  if (job->regex) {
+    regmatch_t m;
+    for (int off = 0; off <= len; off++) {
+      if (regexec(&job->re, text + off, 1, &m, off ? REG_NOTBOL : 0) != 0)
+        break;
+      if (m.rm_eo > m.rm_so) {
+        if (n == SEARCH_BATCH) {
+          search_add(found, n);
+          n = 0;
+        }
+        found[n++] = (SearchMatch){line, cols[off + m.rm_so],
+                                   cols[off + m.rm_eo - 1] + 1};
+      }
+      off += m.rm_eo > m.rm_so ? m.rm_eo - 1 : m.rm_so;
+    }
+    return n;
+  }
+  const char *hay = text;
+  if (job->icase) {
+    for (int i = 0; i < len; i++)
+      folded[i] = ascii_lower(text[i]);
+    hay = folded;
+  }
+  const char *needle = job->icase ? job->literal : job->query;
+  size_t qlen = strlen(needle);
+  for (const char *p = hay; (p = memmem(p, hay + len - p, needle, qlen));
+       p += qlen) {
+    if (n == SEARCH_BATCH) {
+      search_add(found, n);
+      n = 0;
+    }
+    found[n++] =
+        (SearchMatch){line, cols[p - hay], cols[p - hay + qlen - 1] + 1};
+  }
+  return n;
+}
+
+int search_worker(void *arg) {
+  SearchJob *job = arg;
+  SearchMatch *found = malloc(SEARCH_BATCH * sizeof(SearchMatch));
+  uint8_t *buf = NULL;
+  size_t buf_cap = 0;
+  uint32_t offsets[SB_BLOCK_LINES];
+  int literal_len = strlen(job->literal);
+
+  for (int row = job->rows - 1; row >= 0 && !atomic_load(&search_cancel);
+       row--) {
+    int n = search_line(job, job->screen + job->screen_offsets[row],
+                        job->base + row, found, 0);
+    search_add(found, n);
+  }
+
+  // Scrollback, one block at a time, newest first
+  long next = job->base; // Lines from here on are done
+  while (!atomic_load(&search_cancel) && search_count < SEARCH_MAX_MATCHES) {
+    SDL_LockMutex(sb_lock);
+    long index = next - 1 - sb_dropped;
+    if (index >= sb_lines)
+      index = sb_lines - 1; // Lines were popped back onto the screen
+    if (index < 0) {
+      SDL_UnlockMutex(sb_lock);
+      break;
+    }
+    int block = index / SB_BLOCK_LINES;
+    SbBlock *b = sb_blocks[block];
+    long first = sb_dropped + (long)block * SB_BLOCK_LINES;
+    int last = -1; // Lines 0..last are copied out for matching
+    if (bloom_may_contain(sb_block_bloom(b), job->literal, literal_len)) {
+      // Take a private copy so the lock is not held while matching; the
+      // newest block keeps growing and sealed ones may be dropped
+      const uint8_t *raw = sb_block_read(b, &buf, &buf_cap);
+      if (raw != buf) {
+        if (buf_cap < b->raw_len) {
+          buf_cap = b->raw_len;
+          buf = realloc(buf, buf_cap);
+        }
+        memcpy(buf, raw, b->raw_len);
+      }
+      last = index % SB_BLOCK_LINES;
+      for (int line = 0; line <= last; line++)
+        offsets[line] = sb_line_offset(block, raw, line);
+    }
+    SDL_UnlockMutex(sb_lock);
+
+    int n = 0;
+    for (int line = last; line >= 0 && search_count + n < SEARCH_MAX_MATCHES;
+         line--)
+      n = search_line(job, buf + offsets[line], first + line, found, n);
+    search_add(found, n);
+    next = first;
+  }
+
+  atomic_store(&search_done, 1);
+  SDL_Event ev = {.type = search_event};
+  SDL_PushEvent(&ev);
+  free(found);
+  free(buf);
+  free(job->screen);
+  free(job->screen_offsets);
+  if (job->regex)
+    regfree(&job->re);
+  free(job);
+  return 0;
+}
+
+void search_stop() {
+  if (search_thread) {
+    atomic_store(&search_cancel, 1);
+    SDL_WaitThread(search_thread, NULL);
+    search_thread = NULL;
   }
+  search_count = 0;
+  search_selected = -1;
+  dirty = 1;
+}
 
-  child_pid = fork();
-  if (child_pid == 0) {
-    setsid();
-    int slave_fd = open(slave_name, O_RDWR);
-    ioctl(slave_fd, TIOCSCTTY, 0);
-    dup2(slave_fd, 0);
-    dup2(slave_fd, 1);
-    dup2(slave_fd, 2);
-    close(master_fd);
-    close(slave_fd);
+// (Re)starts the search for search_query. Smart case: the search ignores
+// case unless the query has capitals.
+void search_start() {
+  search_stop();
+  search_error = 0;
+  if (!search_query[0])
+    return;
 
-    setenv("TERM", "xterm-256color", 1);
-    unsetenv("COLUMNS");
-    unsetenv("LINES");
-    execlp("bash", "bash", NULL);
-    exit(1);
+  SearchJob *job = calloc(1, sizeof(SearchJob));
+  strcpy(job->query, search_query);
+  job->regex = search_regex;
+  job->icase = 1;
+  for (const char *p = search_query; *p; p++)
+    if (*p >= 'A' && *p <= 'Z')
+      job->icase = 0;
+  if (job->regex) {
+    int flags = REG_EXTENDED | (job->icase ? REG_ICASE : 0);
+    if (regcomp(&job->re, job->query, flags) != 0) {
+      search_error = 1;
+      free(job);
+      return;
+    }
+    regex_literal(job->query, job->literal);
+  } else {
+    for (int i = 0; job->query[i]; i++)
+      job->literal[i] = ascii_lower(job->query[i]);
+  }
+
+  // The worker cannot touch libvterm, so it gets a packed copy of the screen
+  int rows, cols;
+  vterm_get_size(vterm, &rows, &cols);
+  VTermScreenCell *cells = malloc(cols * sizeof(VTermScreenCell));
+  job->screen = malloc(rows * sb_pack_bound(cols));
+  job->screen_offsets = malloc(rows * sizeof(size_t));
+  size_t len = 0;
+  for (int row = 0; row < rows; row++) {
+    for (int col = 0; col < cols; col++) {
+      VTermPos pos = {row, col};
+      vterm_screen_get_cell(vterm_screen, pos, &cells[col]);
+    }
+    job->screen_offsets[row] = len;
+    len += sb_pack_line(cols, cells, job->screen + len);
   }
+  free(cells);
+  job->rows = rows;
+  SDL_LockMutex(sb_lock);
+  job->base = sb_dropped + sb_lines;
+  SDL_UnlockMutex(sb_lock);
+
+  atomic_store(&search_cancel, 0);
+  atomic_store(&search_done, 0);
+  search_thread = SDL_CreateThread(search_worker, "search", job);
 }
 
-// --- Font Loading ---
-void load_font() {
-  int fd = open(FONT_PATH, O_RDONLY);
-  if (fd == -1) {
-    printf("Error opening font: %s\n", FONT_PATH);
-    exit(1);
+void search_close() {
+  search_stop();
+  search_open = 0;
+  search_query[0] = 0;
+}
+
+// Scrolls so the selected match is in view, centered if it was not.
+void search_show_selected() {
+  SDL_LockMutex(search_lock);
+  long line = search_matches[search_selected].line;
+  SDL_UnlockMutex(search_lock);
+  int rows, cols;
+  vterm_get_size(vterm, &rows, &cols);
+  long top = sb_dropped + sb_lines - scroll_offset;
+  if (line < top || line >= top + rows)
+    view_scroll(top - (line - rows / 2));
+  dirty = 1;
+}
+
+void search_type(const char *text) {
+  if (strlen(search_query) + strlen(text) < SEARCH_QUERY_MAX) {
+    strcat(search_query, text);
+    search_start();
   }
-  struct stat sb;
-  fstat(fd, &sb);
-  unsigned char *ttf_buffer =
-      mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  close(fd);
+}
 
-  unsigned char *temp_bitmap = calloc(1, ATLAS_WIDTH * ATLAS_HEIGHT);
+// Keys while the search bar is open; anything else is ignored.
+void search_handle_key(SDL_Keycode key, int mod) {
+  if (key == SDLK_ESCAPE) {
+    search_close();
+  } else if (key == SDLK_BACKSPACE) {
+    int len = strlen(search_query);
+    while (len > 0 && (search_query[--len] & 0xC0) == 0x80)
+      ; // Back to the start of the last UTF-8 character
+    search_query[len] = 0;
+    search_start();
+  } else if (key == SDLK_RETURN) {
+    // Enter walks to older matches, Shift+Enter back to newer ones
+    int step = mod & KMOD_SHIFT ? -1 : 1;
+    SDL_LockMutex(search_lock);
+    int count = search_count; // The worker may still be adding matches
+    SDL_UnlockMutex(search_lock);
+    if (search_selected + step >= 0 && search_selected + step < count) {
+      search_selected += step;
+      search_show_selected();
+    }
+  } else if ((mod & KMOD_CTRL) && key == SDLK_r) {
+    search_regex = !search_regex;
+    search_start();
+  }
+}
 
-  stbtt_pack_context spc;
-  if (!stbtt_PackBegin(&spc, temp_bitmap, ATLAS_WIDTH, ATLAS_HEIGHT, 0, 1,
-                       NULL)) {
-    printf("Failed to init font packer\n");
-    exit(1);
+// Draws UTF-8 text at a pixel position through the glyph batch; flushed by
+// the caller.
+void draw_text(float x, float y, const char *text, SDL_Color color) {
+  for (const uint8_t *p = (const uint8_t *)text; *p; x += cell_width) {
+    uint32_t code = sb_get_utf8(&p);
+    if (code <= ' ' || code >= 0x110000)
+      continue;
+    GlyphRecord *r = glyph_lookup(code, STYLE_REGULAR);
+    if (r->slot >= 0)
+      batch_glyph(&glyph_batch, r, x, y, color);
   }
+}
 
-  // 1. Pack ASCII
-  stbtt_PackFontRange(&spc, ttf_buffer, 0, FONT_SIZE, 32, 96, ascii_chars);
+// Highlights the visible matches and draws the search bar over the last row.
+void draw_search(int rows, int cols) {
+  if (!search_open)
+    return;
+  long top = sb_dropped + sb_lines - scroll_offset;
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+  SDL_LockMutex(search_lock);
+  // Matches are sorted by descending line; find the last visible one
+  int lo = 0, hi = search_count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (search_matches[mid].line >= top + rows)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (int i = lo; i < search_count && search_matches[i].line >= top; i++) {
+    SearchMatch *m = &search_matches[i];
+    SDL_Rect r = {m->col0 * cell_width, (m->line - top) * cell_height,
+                  (m->col1 - m->col0) * cell_width, cell_height};
+    if (i == search_selected)
+      SDL_SetRenderDrawColor(renderer, 255, 120, 0, 150);
+    else
+      SDL_SetRenderDrawColor(renderer, 255, 210, 0, 90);
+    SDL_RenderFillRect(renderer, &r);
+  }
+  int count = search_count;
+  SDL_UnlockMutex(search_lock);
 
-  // 2. Pack Box Drawing (Tmux borders)
-  stbtt_PackFontRange(&spc, ttf_buffer, 0, FONT_SIZE, 0x2500, 128, box_chars);
+  SDL_Rect bar = {0, (rows - 1) * cell_height, cols * cell_width, cell_height};
+  SDL_SetRenderDrawColor(renderer, 48, 48, 48, 255);
+  SDL_RenderFillRect(renderer, &bar);
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
 
-  // 3. Pack Powerline Symbols (The triangles in shell prompts)
-  stbtt_PackFontRange(&spc, ttf_buffer, 0, FONT_SIZE, 0xE0A0, 96,
-                      powerline_chars);
+  char status[64];
+  if (search_error)
+    snprintf(status, sizeof(status), "invalid regex");
+  else if (search_selected >= 0)
+    snprintf(status, sizeof(status), "%d of %d%s", search_selected + 1, count,
+             atomic_load(&search_done) ? "" : "+");
+  else
+    snprintf(status, sizeof(status), "%d match%s%s", count,
+             count == 1 ? "" : "es", atomic_load(&search_done) ? "" : "...");
+  char line[SEARCH_QUERY_MAX + 96];
+  snprintf(line, sizeof(line), "%s: %s", search_regex ? "Regex" : "Find",
+           search_query);
+  SDL_Color fg = {230, 230, 230, 255};
+  draw_text(0, bar.y, line, fg);
+  draw_text((cols - (int)strlen(status) - 1) * cell_width, bar.y, status, fg);
+  batch_flush(&glyph_batch, font_texture);
+}
 
-  // 4. Pack Common Nerd Font Icons (Folder icons, git logos, etc)
-  // This range (E5FA to F500) covers Seti-UI, Devicons, and FontAwesome
-  stbtt_PackFontRange(&spc, ttf_buffer, 0, FONT_SIZE, 0xE5FA, 3800, icon_chars);
+// --- Paste ---
+// Clipboard text goes to the shell one chunk per loop iteration, and only
+// after the PTY has taken the previous chunk, so a huge paste never piles up
+// in pty_out and the window keeps drawing while the shell reads it. libvterm
+// brackets it with ESC[200~ / ESC[201~ when the application asked for that;
+// ESC bytes in the text are dropped so it can neither end the bracket early
+// nor inject control sequences. Newlines are sent as CR, like Enter.
+char *paste_text = NULL; // From SDL_GetClipboardText, NULL when idle
+size_t paste_len = 0, paste_pos = 0;
 
-  stbtt_PackEnd(&spc);
-  munmap(ttf_buffer, sb.st_size);
+void paste_end() {
+  vterm_keyboard_end_paste(vterm);
+  SDL_free(paste_text);
+  paste_text = NULL;
+  dirty = 1;
+}
 
-  SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(
-      0, ATLAS_WIDTH, ATLAS_HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888);
-  SDL_LockSurface(surface);
-  Uint32 *pixels = (Uint32 *)surface->pixels;
+void paste_start() {
+  if (paste_text || !SDL_HasClipboardText())
+    return;
+  char *text = SDL_GetClipboardText();
+  if (!text || !*text || search_open) {
+    if (text && search_open)
+      search_type(text);
+    SDL_free(text);
+    return;
+  }
+  paste_text = text;
+  paste_len = strlen(text);
+  paste_pos = 0;
+  view_reset();
+  vterm_keyboard_start_paste(vterm);
+}
 
-  for (int i = 0; i < ATLAS_WIDTH * ATLAS_HEIGHT; i++) {
-    Uint8 alpha = temp_bitmap[i];
-    pixels[i] = (alpha > 0) ? SDL_MapRGBA(surface->format, 255, 255, 255, alpha)
-                            : SDL_MapRGBA(surface->format, 0, 0, 0, 0);
+// Queues the next chunk once everything before it has been written.
+void paste_feed() {
+  if (!paste_text || pty_out.len)
+    return;
+  char chunk[PASTE_CHUNK];
+  size_t n = 0;
+  while (paste_pos < paste_len && n < sizeof(chunk)) {
+    char c = paste_text[paste_pos++];
+    if (c == '\x1b' ||
+        (c == '\n' && paste_pos >= 2 && paste_text[paste_pos - 2] == '\r'))
+      continue;
+    chunk[n++] = c == '\n' ? '\r' : c;
   }
+  pty_queue(chunk, n);
+  if (paste_pos == paste_len)
+    paste_end();
+  else if (paste_len > PASTE_CHUNK)
+    dirty = 1; // Progress changed
+}
 
-  SDL_UnlockSurface(surface);
-  free(temp_bitmap);
+// Shows how far a paste that spans several chunks has got.
+void draw_paste(int rows, int cols) {
+  if (!paste_text || paste_len <= PASTE_CHUNK)
+    return;
+  SDL_Rect bar = {0, (rows - 1) * cell_height, cols * cell_width, cell_height};
+  SDL_SetRenderDrawColor(renderer, 48, 48, 48, 255);
+  SDL_RenderFillRect(renderer, &bar);
+  SDL_Rect done = bar;
+  done.w = (double)paste_pos / paste_len * bar.w;
+  SDL_SetRenderDrawColor(renderer, 40, 90, 150, 255);
+  SDL_RenderFillRect(renderer, &done);
 
-  font_texture = SDL_CreateTextureFromSurface(renderer, surface);
-  SDL_FreeSurface(surface);
-  SDL_SetTextureBlendMode(font_texture, SDL_BLENDMODE_BLEND);
+  char line[96];
+  snprintf(line, sizeof(line), "Pasting %.1f of %.1f MB (Esc cancels)",
+           paste_pos / 1e6, paste_len / 1e6);
+  draw_text(0, bar.y, line, (SDL_Color){230, 230, 230, 255});
+  batch_flush(&glyph_batch, font_texture);
+}
 
-  // Metrics
-  if (ascii_chars[0].xadvance == 0)
-    ascii_chars[0].xadvance = FONT_SIZE / 2;
-  cell_width = (int)ceilf(ascii_chars[0].xadvance);
-  cell_height = (int)FONT_SIZE;
+// --- Rendering ---
+// Only indexed colors need libvterm's palette; RGB and default colors
+// already carry their value.
+Uint32 resolve_color(VTermState *state, VTermColor c) {
+  if (VTERM_COLOR_IS_INDEXED(&c))
+    vterm_state_convert_color_to_rgb(state, &c);
+  return (Uint32)c.rgb.red << 16 | c.rgb.green << 8 | c.rgb.blue;
+}
 
-  printf("Font loaded. Cell size: %dx%d\n", cell_width, cell_height);
+// Resolves a row of cells and returns its hash.
+uint64_t resolve_row(VTermState *state, const VTermScreenCell *cells,
+                     int cols, ShadowCell *out) {
+  for (int col = 0; col < cols; col++) {
+    const VTermScreenCell *cell = &cells[col];
+    out[col] = (ShadowCell){cell->chars[0], resolve_color(state, cell->fg),
+                            resolve_color(state, cell->bg),
+                            cell_attr_bits(cell)};
+  }
+  return hash_bytes((const unsigned char *)out, cols * sizeof(ShadowCell));
 }
 
-// --- Rendering ---
+SDL_Color unpack_color(Uint32 c) {
+  return (SDL_Color){c >> 16, c >> 8 & 0xFF, c & 0xFF, 255};
+}
+
+// Redraws only the rows damaged since the last frame, and of those only the
+// ones whose content changed, into frame_texture. Then presents the texture
+// with the cursor on top.
 void render_term() {
   VTermState *state = vterm_obtain_state(vterm);
   VTermColor default_fg, default_bg;
   vterm_state_get_default_colors(state, &default_fg, &default_bg);
-  SDL_SetRenderDrawColor(renderer, default_bg.rgb.red, default_bg.rgb.green,
-                         default_bg.rgb.blue, 255);
-  SDL_RenderClear(renderer);
 
   int rows, cols;
   vterm_get_size(vterm, &rows, &cols);
+  ensure_frame_texture(rows, cols);
+
+  SDL_Color bg_color = {default_bg.rgb.red, default_bg.rgb.green,
+                        default_bg.rgb.blue, 255};
+  Uint32 default_bg_rgb = resolve_color(state, default_bg);
+  frame_stats = (FrameStats){0};
+  glyph_frame++;
+  Uint64 build_start = SDL_GetPerformanceCounter();
+
+  static BgSpan *runs = NULL;
+  static VTermScreenCell *line = NULL;
+  static ShadowCell *resolved = NULL;
+  static int runs_cap = 0;
+  if (runs_cap < cols + 1) {
+    runs_cap = cols + 1;
+    runs = realloc(runs, runs_cap * sizeof(BgSpan));
+    line = realloc(line, runs_cap * sizeof(VTermScreenCell));
+    resolved = realloc(resolved, runs_cap * sizeof(ShadowCell));
+  }
+
+  for (int view_row = 0; view_row < rows; view_row++) {
+    // Everything below works in frame_texture rows
+    int row = frame_row(view_row);
+    if (!dirty_rows[row])
+      continue;
+    dirty_rows[row] = 0;
+    frame_stats.rows_checked++;
+
+    view_get_row(view_row, cols, line);
+    ShadowCell *cells = shadow + (size_t)row * cols;
+    uint64_t hash = resolve_row(state, line, cols, resolved);
+    // The hash rejects changed rows cheaply; a match is confirmed in full
+    if (shadow_valid[row] && shadow_hash[row] == hash &&
+        memcmp(cells, resolved, cols * sizeof(ShadowCell)) == 0) {
+      frame_stats.rows_cached++;
+      continue;
+    }
+    memcpy(cells, resolved, cols * sizeof(ShadowCell));
+    shadow_hash[row] = hash;
+    shadow_valid[row] = 1;
+    frame_stats.rows_drawn++;
+
+    float row_top = row * cell_height;
+
+    // The row clear is the first run; non-default runs follow in column order
+    int nruns = 0;
+    runs[nruns++] = (BgSpan){0, cols, row, row + 1, bg_color};
 
-  for (int row = 0; row < rows; row++) {
     for (int col = 0; col < cols; col++) {
-      VTermScreenCell cell;
-      VTermPos pos = {row, col};
-      vterm_screen_get_cell(vterm_screen, pos, &cell);
-
-      uint32_t code = cell.chars[0];
-
-      // Draw Background
-      vterm_state_convert_color_to_rgb(state, &cell.bg);
-      if (cell.bg.rgb.red != default_bg.rgb.red ||
-          cell.bg.rgb.green != default_bg.rgb.green ||
-          cell.bg.rgb.blue != default_bg.rgb.blue) {
-        SDL_SetRenderDrawColor(renderer, cell.bg.rgb.red, cell.bg.rgb.green,
-                               cell.bg.rgb.blue, 255);
-        SDL_Rect bg_rect = {col * cell_width, row * cell_height, cell_width,
-                            cell_height};
-        SDL_RenderFillRect(renderer, &bg_rect);
+      ShadowCell *cell = &cells[col];
+      uint32_t code = cell->code;
+
+      // Background
+      if (cell->bg != default_bg_rgb) {
+        SDL_Color c = unpack_color(cell->bg);
+        BgSpan *last = &runs[nruns - 1];
+        if (nruns > 1 && last->col1 == col && same_color(last->color, c))
+          last->col1++;
+        else
+          runs[nruns++] = (BgSpan){col, col + 1, row, row + 1, c};
       }
 
-      // Resolve Glyph
-      stbtt_packedchar *b = NULL;
-
-      if (code >= 32 && code < 128) {
-        b = &ascii_chars[code - 32];
-      } else if (code >= 0x2500 && code < 0x2580) {
-        b = &box_chars[code - 0x2500];
-      } else if (code >= 0xE0A0 && code < 0xE100) {
-        b = &powerline_chars[code - 0xE0A0];
-      } else if (code >= 0xE5FA && code < 0xF500) {
-        b = &icon_chars[code - 0xE5FA];
-      } else {
+      // Resolve Glyph; blanks and wide-char continuations (-1) draw nothing
+      if (code <= ' ' || code >= 0x110000)
+        continue;
+      int style = cell->attrs & SB_BOLD ? STYLE_BOLD : STYLE_REGULAR;
+      GlyphRecord *r = glyph_lookup(code, style);
+      if (r->slot < 0)
         continue;
-      }
 
-      // Draw Glyph
-      vterm_state_convert_color_to_rgb(state, &cell.fg);
-      SDL_SetTextureColorMod(font_texture, cell.fg.rgb.red, cell.fg.rgb.green,
-                             cell.fg.rgb.blue);
+      // Draw Glyph; the quad never leaves its row
+      batch_glyph(&glyph_batch, r, col * cell_width, row_top,
+                  unpack_color(cell->fg));
+      frame_stats.glyphs++;
+    }
 
-      stbtt_aligned_quad q;
-      float x = col * cell_width;
-      float y = (row * cell_height) + (cell_height * 0.75f);
+    spans_add_row(row, runs, nruns, bg_color);
+  }
+  spans_emit(bg_color);
+  Uint64 submit_start = SDL_GetPerformanceCounter();
+  frame_stats.build_ticks = submit_start - build_start;
 
-      stbtt_GetPackedQuad(b, ATLAS_WIDTH, ATLAS_HEIGHT, 0, &x, &y, &q, 1);
+  SDL_SetRenderTarget(renderer, frame_texture);
+  batch_flush(&bg_batch, NULL);
+  batch_flush(&glyph_batch, font_texture);
+  SDL_SetRenderTarget(renderer, NULL);
 
-      SDL_Rect src = {(int)(q.s0 * ATLAS_WIDTH), (int)(q.t0 * ATLAS_HEIGHT),
-                      (int)((q.s1 - q.s0) * ATLAS_WIDTH),
-                      (int)((q.t1 - q.t0) * ATLAS_HEIGHT)};
-      SDL_Rect dst = {(int)q.x0, (int)q.y0, (int)(q.x1 - q.x0),
-                      (int)(q.y1 - q.y0)};
-      SDL_RenderCopy(renderer, font_texture, &src, &dst);
-    }
+  SDL_SetRenderDrawColor(renderer, default_bg.rgb.red, default_bg.rgb.green,
+                         default_bg.rgb.blue, 255);
+  SDL_RenderClear(renderer);
+  // The ring's top part first, then the rows that wrapped around
+  int w = cols * cell_width, split = (rows - frame_top) * cell_height;
+  SDL_Rect top_src = {0, frame_top * cell_height, w, split};
+  SDL_Rect top_dst = {0, 0, w, split};
+  SDL_RenderCopy(renderer, frame_texture, &top_src, &top_dst);
+  if (frame_top) {
+    SDL_Rect wrap_src = {0, 0, w, frame_top * cell_height};
+    SDL_Rect wrap_dst = {0, split, w, frame_top * cell_height};
+    SDL_RenderCopy(renderer, frame_texture, &wrap_src, &wrap_dst);
   }
 
-  // Cursor
-  VTermPos cursor_pos;
-  vterm_state_get_cursorpos(state, &cursor_pos);
-  if ((SDL_GetTicks() / 500) % 2) {
-    SDL_Rect cursor_rect = {cursor_pos.col * cell_width,
-                            cursor_pos.row * cell_height, cell_width,
-                            cell_height};
-    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 128);
-    SDL_RenderFillRect(renderer, &cursor_rect);
-    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
-  }
+  draw_cursor(state);
+  draw_search(rows, cols);
+  draw_paste(rows, cols);
 
   SDL_RenderPresent(renderer);
   dirty = 0;
+  static Uint64 last_present = 0;
+  Uint64 presented = SDL_GetPerformanceCounter();
+  frame_stats.submit_ticks = presented - submit_start;
+  frame_stats.present_gap = last_present ? presented - last_present : 0;
+  last_present = presented;
+
+  total_rows_checked += frame_stats.rows_checked;
+  total_rows_cached += frame_stats.rows_cached;
+  double ms = 1000.0 / SDL_GetPerformanceFrequency();
+  if (show_stats)
+    fprintf(stderr,
+            "frame: rows=%d/%d cached=%d (%.1f%% overall) bg_rects=%d "
+            "glyphs=%d submit=%.2fms since_last=%.2fms\n",
+            frame_stats.rows_drawn, frame_stats.rows_checked,
+            frame_stats.rows_cached,
+            total_rows_checked ? 100.0 * total_rows_cached / total_rows_checked
+                               : 0,
+            frame_stats.bg_rects, frame_stats.glyphs,
+            frame_stats.submit_ticks * ms, frame_stats.present_gap * ms);
+}
+
+// --- Frame Pacing ---
+// Parsing runs continuously; frames are presented at most once per display
+// refresh, and only when something changed. next_frame is the only pacer:
+// the renderer is created without vsync, so a present never blocks parsing
+// and never waits out an extra refresh for a deadline just past vblank.
+Uint64 frame_interval; // Performance counter ticks per display refresh
+Uint64 next_frame;     // Earliest time the next frame may be presented
+int throughput_mode = THROUGHPUT_MODE;
+int flooding = 0; // Output rate is above THROUGHPUT_RATE
+
+Uint64 rate_window_start;
+size_t rate_window_bytes;
+
+void update_frame_interval() {
+  SDL_DisplayMode mode;
+  int hz = 60;
+  if (SDL_GetWindowDisplayMode(window, &mode) == 0 && mode.refresh_rate > 0)
+    hz = mode.refresh_rate;
+  frame_interval = SDL_GetPerformanceFrequency() / hz;
+}
+
+// Tracks the PTY output rate over quarter-second windows.
+void pacing_account(size_t bytes, Uint64 now) {
+  Uint64 freq = SDL_GetPerformanceFrequency();
+  rate_window_bytes += bytes;
+  if (now - rate_window_start < freq / 4)
+    return;
+  double rate = (double)rate_window_bytes * freq / (now - rate_window_start);
+  flooding = rate > THROUGHPUT_RATE;
+  rate_window_start = now;
+  rate_window_bytes = 0;
+}
+
+Uint64 current_frame_interval() {
+  if (throughput_mode && flooding)
+    return SDL_GetPerformanceFrequency() / THROUGHPUT_FPS;
+  return frame_interval;
+}
+
+// Milliseconds the main loop may sleep for: 0 while output is queued or a
+// paste can send its next chunk, until
+// the frame deadline when something needs presenting, until the next blink
+// otherwise, and -1 (forever) when nothing at all is pending.
+int next_wakeup() {
+  if (pty_pending() || (pty_hung_up() && !replay_done) ||
+      (paste_text && !pty_out.len) ||
+      (rebuild && atomic_load(&rebuild->done)))
+    return 0;
+  int timeout = cursor_next_change(SDL_GetTicks());
+  if (dirty) {
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint64 left = next_frame > now ? next_frame - now : 0;
+    int frame = (left * 1000 + SDL_GetPerformanceFrequency() - 1) /
+                SDL_GetPerformanceFrequency();
+    if (timeout < 0 || frame < timeout)
+      timeout = frame;
+  }
+  return timeout;
 }
 
 // --- Main ---
+// Screen rows sit scroll_offset rows lower in the view
 static int damage(VTermRect r, void *u) {
+  mark_rows_dirty(r.start_row + scroll_offset, r.end_row + scroll_offset);
+  return 1;
+}
+static int moverect(VTermRect dest, VTermRect src, void *u) {
+  // While scrolled back the screen is only part of the view; repaint
+  if (scroll_offset || !frame_scroll(dest, src))
+    mark_rows_dirty(dest.start_row + scroll_offset,
+                    dest.end_row + scroll_offset);
+  return 1;
+}
+static int sb_pushline(int cols, const VTermScreenCell *cells, void *u) {
+  SDL_LockMutex(sb_lock);
+  sb_push(cols, cells);
+  SDL_UnlockMutex(sb_lock);
+  // Keep a scrolled-back view on the same text while output continues
+  if (scroll_offset && scroll_offset < sb_lines)
+    scroll_offset++;
+  return 1;
+}
+static int sb_popline(int cols, VTermScreenCell *cells, void *u) {
+  if (scroll_offset)
+    scroll_offset--;
+  SDL_LockMutex(sb_lock);
+  int popped = sb_pop(cols, cells);
+  SDL_UnlockMutex(sb_lock);
+  return popped;
+}
+static int sb_clear_cb(void *u) {
+  search_stop(); // Its matches refer to the old history
+  sb_clear();
+  mark_all_dirty();
+  return 1;
+}
+static void out_cb(const char *s, size_t l, void *u) { pty_queue(s, l); }
+static int settermprop(VTermProp prop, VTermValue *val, void *u) {
+  if (prop == VTERM_PROP_CURSORVISIBLE)
+    cursor_visible = val->boolean;
+  else if (prop == VTERM_PROP_CURSORBLINK)
+    cursor_blink = val->boolean;
+  else
+    return 0;
   dirty = 1;
   return 1;
 }
-static void out_cb(const char *s, size_t l, void *u) { write(master_fd, s, l); }
-static VTermScreenCallbacks cbs = {.damage = damage};
-
-int main() {
-  spawn_shell();
+static VTermScreenCallbacks cbs = {.damage = damage,
+                                   .moverect = moverect,
+                                   .settermprop = settermprop,
+                                   .sb_pushline = sb_pushline,
+                                   .sb_popline = sb_popline,
+                                   .sb_clear = sb_clear_cb};
 
+void init_vterm() {
   vterm = vterm_new(24, 80);
   vterm_output_set_callback(vterm, out_cb, NULL);
   vterm_screen = vterm_obtain_screen(vterm);
   vterm_screen_set_callbacks(vterm_screen, &cbs, NULL);
+  // Merge damage into one rect per flush; pty_drain flushes once per drain.
+  vterm_screen_set_damage_merge(vterm_screen, VTERM_DAMAGE_SCROLL);
+  // Full-screen programs draw on the alternate screen and stay out of the
+  // scrollback
+  vterm_screen_enable_altscreen(vterm_screen, 1);
   vterm_screen_reset(vterm_screen, 1);
+  if (!sb_lock)
+    sb_lock = SDL_CreateMutex();
+  sb_clear();
   vterm_set_utf8(vterm, 1);
 
   VTermState *state = vterm_obtain_state(vterm);
   VTermColor fg = {.type = VTERM_COLOR_RGB, .rgb = {255, 255, 255}};
   VTermColor bg = {.type = VTERM_COLOR_RGB, .rgb = {0, 0, 0}};
   vterm_state_set_default_colors(state, &fg, &bg);
+}
+
+// Applies a new grid size to libvterm, the frame and the shell.
+void resize_term(int rows, int cols) {
+  vterm_set_size(vterm, rows, cols);
+  vterm_screen_flush_damage(vterm_screen);
+  struct winsize ws = {rows, cols, 0, 0};
+  if (master_fd >= 0)
+    ioctl(master_fd, TIOCSWINSZ, &ws);
+  mark_all_dirty();
+  if (record_file) {
+    int32_t size[2] = {rows, cols};
+    record_write(RECORD_RESIZE, size, sizeof(size));
+  }
+}
+
+// Sends user input to the shell, returning the view to the live screen.
+void send_input(const char *data, size_t len) {
+  view_reset();
+  pty_queue(data, len);
+}
+
+// Fits the grid to the window at the current cell size.
+void zoom_fit() {
+  int w, h;
+  SDL_GetWindowSize(window, &w, &h);
+  // A replay owns the grid size; the window just shows what fits
+  if (!replay_path)
+    resize_term(h / cell_height, w / cell_width);
+}
+
+// Changes the font size. The shell sees the new grid size once the atlas
+// for it is ready, so a burst of zoom steps resizes it only once. Stepping
+// back to the atlas size drops the pending build instead.
+void zoom_to(float size) {
+  // Magnified, an SDF atlas would be filtered as alpha into blurred edges
+  float max = sdf_atlas ? SDF_SIZE : ZOOM_MAX;
+  size = size < ZOOM_MIN ? ZOOM_MIN : size > max ? max : size;
+  if (size == font_size)
+    return;
+  font_set_size(size);
+  if (sdf_atlas) {
+    zoom_fit();
+  } else if (size == atlas_metrics.size) {
+    atlas_rebuild_cancel();
+    zoom_fit();
+  } else if (!rebuild || rebuild->metrics.size != size) {
+    atlas_rebuild_start();
+  }
+}
+
+// Terminal shortcuts live on Ctrl+Shift, plus Shift+PgUp/PgDn to page
+// through scrollback, Shift+Insert to paste, Escape to cancel a paste and
+// Ctrl+= / Ctrl+- / Ctrl+0 to zoom. Returns 1 if the key was consumed.
+int handle_shortcut(SDL_Keycode key, int mod) {
+  if (paste_text && key == SDLK_ESCAPE) {
+    paste_end();
+    return 1;
+  }
+  if (((mod & KMOD_SHIFT) && key == SDLK_INSERT) ||
+      ((mod & KMOD_CTRL) && (mod & KMOD_SHIFT) && key == SDLK_v)) {
+    paste_start();
+    return 1;
+  }
+  if ((mod & KMOD_SHIFT) && (key == SDLK_PAGEUP || key == SDLK_PAGEDOWN)) {
+    int rows, cols;
+    vterm_get_size(vterm, &rows, &cols);
+    view_scroll(key == SDLK_PAGEUP ? rows - 1 : -(rows - 1));
+    return 1;
+  }
+  if ((mod & KMOD_CTRL) &&
+      (key == SDLK_EQUALS || key == SDLK_PLUS || key == SDLK_KP_PLUS)) {
+    zoom_to(font_size + ZOOM_STEP);
+    return 1;
+  }
+  if ((mod & KMOD_CTRL) && (key == SDLK_MINUS || key == SDLK_KP_MINUS)) {
+    zoom_to(font_size - ZOOM_STEP);
+    return 1;
+  }
+  if ((mod & KMOD_CTRL) && key == SDLK_0) {
+    zoom_to(FONT_SIZE);
+    return 1;
+  }
+  if (!(mod & KMOD_CTRL) || !(mod & KMOD_SHIFT))
+    return 0;
+  if (key == SDLK_f) {
+    if (search_open) {
+      search_close();
+    } else {
+      search_open = 1;
+      dirty = 1;
+    }
+    return 1;
+  }
+  if (key == SDLK_t) {
+    throughput_mode = !throughput_mode;
+    return 1;
+  }
+  return 0;
+}
+
+// --- Benchmarks ---
+// Headless runs of the parse + render pipeline against SDL's software
+// renderer. Workloads are either synthesized below or raw PTY captures given
+// on the command line (e.g. from `script -q -c 'ls -R --color' out.raw`).
+#define BENCH_ROWS 50
+#define BENCH_COLS 160
+#define BENCH_FRAME_BYTES INGEST_MIN_BYTES // Input parsed per rendered frame
+
+double bench_seconds(Uint64 start) {
+  return (double)(SDL_GetPerformanceCounter() - start) /
+         SDL_GetPerformanceFrequency();
+}
+
+// The atlas conversion as load_font() used to do it: SDL_MapRGBA per pixel
+void expand_coverage_mapped(const unsigned char *src, SDL_Surface *surface,
+                            size_t n) {
+  Uint32 *pixels = surface->pixels;
+  for (size_t i = 0; i < n; i++) {
+    Uint8 alpha = src[i];
+    pixels[i] = (alpha > 0) ? SDL_MapRGBA(surface->format, 255, 255, 255, alpha)
+                            : SDL_MapRGBA(surface->format, 0, 0, 0, 0);
+  }
+}
+
+// Converts a full atlas with each implementation. The coverage is
+// synthetic: two thirds of the pixels empty, the rest pseudo-random, so the
+// branch in the SDL_MapRGBA loop is hard to predict as with glyph edges.
+void bench_atlas_conversion() {
+  size_t n = (size_t)ATLAS_WIDTH * ATLAS_HEIGHT;
+  unsigned char *src = malloc(n);
+  for (size_t i = 0; i < n; i++)
+    src[i] = (i * 2654435761u >> 13) % 3 ? 0 : (i * 40503u >> 7) & 0xFF;
+  Uint32 *dst = malloc(n * sizeof(Uint32));
+  SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(
+      0, ATLAS_WIDTH, ATLAS_HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888);
+
+  const int reps = 10;
+  Uint64 start = SDL_GetPerformanceCounter();
+  for (int r = 0; r < reps; r++) {
+    SDL_LockSurface(surface);
+    expand_coverage_mapped(src, surface, n);
+    SDL_UnlockSurface(surface);
+  }
+  printf("atlas %dx%d, %d runs each\n", ATLAS_WIDTH, ATLAS_HEIGHT, reps);
+  printf("  SDL_MapRGBA  %8.3f ms\n", bench_seconds(start) * 1000 / reps);
+
+  struct {
+    const char *name;
+    void (*fn)(const unsigned char *, Uint32 *, size_t);
+    int supported;
+  } impls[] = {
+      {"scalar", expand_coverage_scalar, 1},
+#if defined(__SSE2__)
+      {"sse2", expand_coverage_sse2, 1},
+      {"avx2", expand_coverage_avx2, SDL_HasAVX2()},
+#endif
+  };
+  for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+    if (!impls[k].supported)
+      continue;
+    start = SDL_GetPerformanceCounter();
+    for (int r = 0; r < reps; r++)
+      impls[k].fn(src, dst, n);
+    printf("  %-12s %8.3f ms\n", impls[k].name,
+           bench_seconds(start) * 1000 / reps);
+  }
+
+  SDL_FreeSurface(surface);
+  free(dst);
+  free(src);
+}
+
+unsigned bench_rand_state = 1;
+unsigned bench_rand() {
+  bench_rand_state = bench_rand_state * 1103515245u + 12345u;
+  return bench_rand_state >> 8;
+}
+
+const char *bench_words[] = {
+    "request", "worker",  "compile", "linking", "cache",   "socket",
+    "timeout", "handler", "session", "buffer",  "flush",   "retry",
+    "module",  "parser",  "render",  "scroll",  "texture", "glyph"};
+#define BENCH_WORD (bench_words[bench_rand() % 18])
+
+// `cat` of a large build/server log: plain text, mostly scrolling
+void bench_gen_log(ByteBuf *b) {
+  for (int i = 0; i < 200000; i++) {
+    buf_printf(b, "[2024-03-%02d %02d:%02d:%02d.%03d] %s %s-%d: %s %s id=%u",
+               i / 10000 % 28 + 1, i / 3600 % 24, i / 60 % 60, i % 60,
+               bench_rand() % 1000, i % 50 ? "INFO " : "WARN ", BENCH_WORD,
+               bench_rand() % 16, BENCH_WORD, BENCH_WORD, bench_rand());
+    for (int w = bench_rand() % 6; w > 0; w--)
+      buf_printf(b, " %s", BENCH_WORD);
+    buf_append(b, "\r\n", 2);
+  }
+}
+
+// `yes | head -n 2000000`: the cheapest possible line, all scrolling
+void bench_gen_yes(ByteBuf *b) {
+  for (int i = 0; i < 2000000; i++)
+    buf_append(b, "y\r\n", 3);
+}
+
+// `ls -R --color`: short SGR-colored names in columns, directory headers
+void bench_gen_ls(ByteBuf *b) {
+  static const char *colors[] = {"01;34", "01;32", "0", "01;36", "01;31"};
+  for (int d = 0; d < 8000; d++) {
+    buf_printf(b, "\r\n./src/%s/%s%d:\r\n", BENCH_WORD, BENCH_WORD, d);
+    for (int n = bench_rand() % 40 + 4; n > 0; n--) {
+      buf_printf(b, "\x1b[%sm%s_%s.%s\x1b[0m  ", colors[bench_rand() % 5],
+                 BENCH_WORD, BENCH_WORD, n % 3 ? "c" : "o");
+      if (n % 5 == 0)
+        buf_append(b, "\r\n", 2);
+    }
+    buf_append(b, "\r\n", 2);
+  }
+}
+
+// vim scrolling through a highlighted file: a scroll region above a status
+// line, one new syntax-colored line per step
+void bench_gen_vim(ByteBuf *b) {
+  buf_printf(b, "\x1b[?1049h\x1b[H\x1b[2J\x1b[1;%dr", BENCH_ROWS - 1);
+  for (int i = 0; i < 40000; i++) {
+    buf_printf(b, "\x1b[%d;1H\n\x1b[%d;1H\x1b[33m%5d \x1b[0m", BENCH_ROWS - 1,
+               BENCH_ROWS - 1, i);
+    buf_printf(b,
+               "  \x1b[38;5;81mstatic\x1b[0m \x1b[38;5;118mint\x1b[0m "
+               "%s_%s(\x1b[38;5;208m%u\x1b[0m); \x1b[38;5;242m// %s %s\x1b[0m",
+               BENCH_WORD, BENCH_WORD, bench_rand() % 1000, BENCH_WORD,
+               BENCH_WORD);
+    buf_printf(b, "\x1b[%d;1H\x1b[7m src/main.c  line %d \x1b[K\x1b[0m",
+               BENCH_ROWS, i);
+  }
+  buf_printf(b, "\x1b[r\x1b[?1049l");
+}
+
+// htop refreshing: cursor-addressed rows of colored meters and a process
+// table with background-colored header, repainted in place
+void bench_gen_htop(ByteBuf *b) {
+  buf_printf(b, "\x1b[?1049h\x1b[2J");
+  for (int frame = 0; frame < 1500; frame++) {
+    for (int cpu = 0; cpu < 8; cpu++) {
+      int used = bench_rand() % 60;
+      buf_printf(b, "\x1b[%d;3H\x1b[36m%2d\x1b[0m[\x1b[32m", cpu + 1, cpu);
+      for (int i = 0; i < 60; i++)
+        buf_append(b, i < used ? "|" : " ", 1);
+      buf_printf(b, "\x1b[0m%5.1f%%]", used * 100.0 / 60);
+    }
+    buf_printf(b, "\x1b[10;1H\x1b[30;42m  PID USER      PRI  NI  VIRT   RES "
+                  "  CPU%% MEM%%  Command\x1b[K\x1b[0m");
+    for (int row = 11; row <= BENCH_ROWS; row++)
+      buf_printf(b, "\x1b[%d;1H%5u \x1b[34m%-8s\x1b[0m  20   0 %5uM %4uM "
+                    "\x1b[1m%5.1f\x1b[0m %4.1f  /usr/bin/%s --%s\x1b[K",
+                 row, bench_rand() % 99999, BENCH_WORD, bench_rand() % 9999,
+                 bench_rand() % 999, bench_rand() % 1000 / 10.0,
+                 bench_rand() % 100 / 10.0, BENCH_WORD, BENCH_WORD);
+  }
+  buf_printf(b, "\x1b[?1049l");
+}
+
+// Parses data in BENCH_FRAME_BYTES steps, rendering a frame after each one,
+// then once more parse-only for the raw parser rate.
+void bench_run(const char *name, const char *data, size_t len) {
+  init_vterm();
+  vterm_set_size(vterm, BENCH_ROWS, BENCH_COLS);
+  mark_all_dirty();
+
+  Uint64 parse = 0, build = 0, submit = 0;
+  int frames = 0;
+  total_rows_checked = total_rows_cached = 0;
+  Uint64 start = SDL_GetPerformanceCounter();
+  for (size_t off = 0; off < len; off += BENCH_FRAME_BYTES) {
+    size_t n = len - off < BENCH_FRAME_BYTES ? len - off : BENCH_FRAME_BYTES;
+    Uint64 t = SDL_GetPerformanceCounter();
+    vterm_input_write(vterm, data + off, n);
+    vterm_screen_flush_damage(vterm_screen);
+    parse += SDL_GetPerformanceCounter() - t;
+    if (dirty) {
+      render_term();
+      build += frame_stats.build_ticks;
+      submit += frame_stats.submit_ticks;
+      frames++;
+    }
+  }
+  double total = bench_seconds(start);
+  vterm_free(vterm);
+
+  init_vterm();
+  vterm_set_size(vterm, BENCH_ROWS, BENCH_COLS);
+  start = SDL_GetPerformanceCounter();
+  vterm_input_write(vterm, data, len);
+  vterm_screen_flush_damage(vterm_screen);
+  double parse_only = bench_seconds(start);
+  vterm_free(vterm);
+  vterm = NULL;
+
+  double freq = SDL_GetPerformanceFrequency();
+  double mb = len / 1048576.0;
+  printf("%-10s %8.1f MB %9.1f MB/s %9.1f MB/s %7d %8.1f %7.3f %7.3f %7.3f "
+         "%5.1f%%\n",
+         name, mb, mb / parse_only, mb / total, frames, frames / total,
+         frames ? parse / freq * 1000 / frames : 0,
+         frames ? build / freq * 1000 / frames : 0,
+         frames ? submit / freq * 1000 / frames : 0,
+         total_rows_checked ? 100.0 * total_rows_cached / total_rows_checked
+                            : 0);
+}
+
+// Pushes a million lines of colored build output through libvterm into the
+// scrollback and reports what they cost to hold.
+void bench_scrollback() {
+  const int total = 1000000, chunk = 10000;
+  init_vterm();
+  vterm_set_size(vterm, BENCH_ROWS, BENCH_COLS);
+  mark_all_dirty();
+
+  Uint64 start = SDL_GetPerformanceCounter();
+  size_t input = 0;
+  for (int i = 0; i < total; i += chunk) {
+    ByteBuf b = {0};
+    for (int j = i; j < i + chunk; j++) {
+      if (j == total / 2) // Something to search for
+        buf_printf(&b, "/usr/bin/ld: cannot find -loolong_bench\r\n");
+      else if (j % 40 == 39)
+        buf_printf(&b,
+                   "\x1b[1msrc/%s/%s.c:%u:%u: \x1b[35mwarning: \x1b[0m"
+                   "\x1b[1munused variable '%s'\x1b[0m\r\n",
+                   BENCH_WORD, BENCH_WORD, bench_rand() % 2000,
+                   bench_rand() % 80, BENCH_WORD);
+      else
+        buf_printf(&b, "[%3d%%] Building C object src/CMakeFiles/%s.dir/%s/"
+                       "%s_%s.c.o\r\n",
+                   j * 100 / total, BENCH_WORD, BENCH_WORD, BENCH_WORD,
+                   BENCH_WORD);
+    }
+    vterm_input_write(vterm, b.data, b.len);
+    input += b.len;
+    free(b.data);
+  }
+  double secs = bench_seconds(start);
+
+  int compressed = 0;
+  for (int i = 0; i < sb_nblocks; i++)
+    compressed += sb_blocks[i]->compressed;
+  printf("scrollback: %d lines (%.1f MB of output) in %.3f s\n", total,
+         input / 1048576.0, secs);
+  printf("  held %ld lines in %.1f MB (%.1f bytes/line), %d/%d blocks "
+         "compressed, %.1f MB spilled to disk\n",
+         sb_lines, sb_bytes / 1048576.0,
+         (double)(sb_bytes + sb_spill_size) / sb_lines, compressed, sb_nblocks,
+         sb_spill_size / 1048576.0);
+
+  start = SDL_GetPerformanceCounter();
+  VTermScreenCell *cells = malloc(BENCH_COLS * sizeof(VTermScreenCell));
+  for (long i = 0; i < sb_lines; i += 97)
+    sb_get_line(i, BENCH_COLS, cells);
+  printf("  random line reads: %.2f us/line\n",
+         bench_seconds(start) * 1e6 / (sb_lines / 97 + 1));
+  free(cells);
+
+  // Searches run to completion on the worker: a line that occurs once, a
+  // word that never does, and a regex that matches every warning
+  struct {
+    const char *query;
+    int regex;
+  } searches[] = {{"cannot find -loolong", 0},
+                  {"segfault", 0},
+                  {"warning: .*'(cache|glyph)'", 1}};
+  search_init();
+  for (size_t i = 0; i < sizeof(searches) / sizeof(searches[0]); i++) {
+    strcpy(search_query, searches[i].query);
+    search_regex = searches[i].regex;
+    start = SDL_GetPerformanceCounter();
+    search_start();
+    SDL_WaitThread(search_thread, NULL);
+    search_thread = NULL;
+    printf("  search %-30s %6d matches in %8.2f ms\n", searches[i].query,
+           search_count, bench_seconds(start) * 1000);
+  }
+  search_stop();
+  vterm_free(vterm);
+  vterm = NULL;
+  sb_clear();
+}
+
+// Steps the font size up and down over a screen of text, timing the first
+// frame at each size and the frame once the atlas for it is in place: with a
+// coverage atlas, rebuilt on a worker thread, and with an SDF atlas, which
+// only re-uploads.
+void bench_zoom() {
+  SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(
+      0, 2560, 1600, 32, SDL_PIXELFORMAT_ARGB8888);
+  renderer = SDL_CreateSoftwareRenderer(surface);
+  if (!renderer) {
+    printf("Failed to create software renderer: %s\n", SDL_GetError());
+    exit(1);
+  }
+  atlas_cache_enabled = 0; // Each size starts from an empty atlas
+  load_font();
+  init_vterm();
+  vterm_set_size(vterm, BENCH_ROWS, BENCH_COLS);
+  ByteBuf b = {0};
+  bench_rand_state = 1;
+  bench_gen_ls(&b);
+  vterm_input_write(vterm, b.data, b.len < (1 << 20) ? b.len : (1 << 20));
+  vterm_screen_flush_damage(vterm_screen);
+  free(b.data);
+
+  printf("%d x %d cells, %.0f px stepped by %.0f px\n", BENCH_COLS, BENCH_ROWS,
+         FONT_SIZE, ZOOM_STEP);
+  for (int mode = 0; mode < 2; mode++) {
+    sdf_atlas = mode;
+    font_use_metrics(font_metrics(FONT_SIZE));
+    atlas_setup();
+    font_set_size(FONT_SIZE);
+    render_term();
+    double first = 0, worst = 0, sharp = 0, resize = 0;
+    int steps = 0, rasterized = 0;
+    // Up six steps, down twelve, back up six
+    for (int i = 1; i <= 24; i++) {
+      int level = i <= 6 ? i : i <= 18 ? 12 - i : i - 24;
+      Uint64 start = SDL_GetPerformanceCounter();
+      font_set_size(FONT_SIZE + level * ZOOM_STEP);
+      resize += bench_seconds(start) * 1000; // The SDF re-upload
+      if (!sdf_atlas)
+        atlas_rebuild_start();
+      render_term();
+      double ms = bench_seconds(start) * 1000;
+      rasterized += frame_stats.rasterized;
+      while (rebuild && !atlas_rebuild_finish())
+        if (!atomic_load(&rebuild->done))
+          SDL_Delay(1);
+      if (!sdf_atlas) {
+        render_term();
+        rasterized += frame_stats.rasterized;
+      }
+      first += ms;
+      worst = ms > worst ? ms : worst;
+      sharp += bench_seconds(start) * 1000;
+      steps++;
+    }
+    printf("%-8s zoom: font_set_size %6.2f ms, first frame %6.2f ms avg "
+           "%6.2f ms worst, final atlas %6.2f ms, %5.1f glyphs rasterized/step "
+           "on the UI thread\n",
+           mode ? "sdf" : "coverage", resize / steps, first / steps, worst,
+           sharp / steps, (double)rasterized / steps);
+  }
+
+  // A full atlas rasterized again at the next size with more and more
+  // worker threads; the build is dropped once done
+  sdf_atlas = 0;
+  font_use_metrics(font_metrics(FONT_SIZE));
+  atlas_setup();
+  for (int gi = 1; gi < faces[0].numGlyphs && glyph_slots_used < glyph_slots;
+       gi++)
+    glyph_get(gi, STYLE_REGULAR);
+  font_set_size(FONT_SIZE + ZOOM_STEP);
+  int cpus = SDL_GetCPUCount();
+  for (int threads = 1;; threads *= 2) {
+    atlas_threads = threads < cpus ? threads : cpus;
+    Uint64 start = SDL_GetPerformanceCounter();
+    atlas_rebuild_start();
+    while (!atomic_load(&rebuild->done))
+      SDL_Delay(1);
+    printf("full atlas rebuild: %d glyphs, %2d threads: %7.2f ms\n",
+           rebuild->count, atlas_threads, bench_seconds(start) * 1000);
+    atlas_rebuild_cancel();
+    if (atlas_threads == cpus)
+      break;
+  }
+  atlas_threads = ATLAS_THREADS;
+  vterm_free(vterm);
+  vterm = NULL;
+  SDL_DestroyRenderer(renderer);
+  SDL_FreeSurface(surface);
+}
+
+int bench_main(int argc, char **argv) {
+  // The grid is drawn into its own texture; the output only has to exist
+  SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(
+      0, 2560, 1600, 32, SDL_PIXELFORMAT_ARGB8888);
+  renderer = SDL_CreateSoftwareRenderer(surface);
+  if (!renderer) {
+    printf("Failed to create software renderer: %s\n", SDL_GetError());
+    return 1;
+  }
+  atlas_cache_enabled = 0; // Glyphs are rasterized inside the timed runs
+  load_font();
+
+  printf("%d x %d cells, %d KiB parsed per frame\n", BENCH_COLS, BENCH_ROWS,
+         BENCH_FRAME_BYTES >> 10);
+  printf("%-10s %11s %14s %14s %7s %8s %7s %7s %7s %6s\n", "workload",
+         "input", "parse-only", "end-to-end", "frames", "fps", "parse", "build",
+         "submit", "cached");
+  printf("%-10s %11s %14s %14s %7s %8s %7s %7s %7s %6s\n", "", "", "", "", "",
+         "", "ms/f", "ms/f", "ms/f", "rows");
+
+  if (argc > 0) {
+    for (int i = 0; i < argc; i++) {
+      int fd = open(argv[i], O_RDONLY);
+      struct stat sb;
+      if (fd == -1 || fstat(fd, &sb) == -1) {
+        printf("Cannot open %s\n", argv[i]);
+        return 1;
+      }
+      char *data = sb.st_size ? mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
+                                     fd, 0)
+                              : NULL;
+      close(fd);
+      const char *base = strrchr(argv[i], '/');
+      base = base ? base + 1 : argv[i];
+      if (data && is_recording(data, sb.st_size)) {
+        // Only the output stream of a recording is benchmarked
+        ByteBuf b = {0};
+        size_t off = 8;
+        RecordHeader rec;
+        const char *payload;
+        while ((payload = record_next(data, sb.st_size, &off, &rec)))
+          if (rec.type == RECORD_DATA)
+            buf_append(&b, payload, rec.len);
+        bench_run(base, b.data, b.len);
+        free(b.data);
+      } else {
+        bench_run(base, data, sb.st_size);
+      }
+      if (data)
+        munmap(data, sb.st_size);
+    }
+  } else {
+    struct {
+      const char *name;
+      void (*gen)(ByteBuf *);
+    } workloads[] = {{"yes", bench_gen_yes},
+                     {"cat-log", bench_gen_log},
+                     {"ls-color", bench_gen_ls},
+                     {"vim-scroll", bench_gen_vim},
+                     {"htop", bench_gen_htop}};
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+      ByteBuf b = {0};
+      bench_rand_state = 1;
+      workloads[i].gen(&b);
+      bench_run(workloads[i].name, b.data, b.len);
+      free(b.data);
+    }
+  }
+
+  SDL_DestroyRenderer(renderer);
+  SDL_FreeSurface(surface);
+  return 0;
+}
+
+void usage(const char *prog) {
+  printf("usage: %s [--sdf] [--record FILE | --replay FILE [--fast]]\n"
+         "       %s --bench [FILE...]\n"
+         "       %s --bench-atlas\n"
+         "       %s --bench-scrollback\n"
+         "       %s --bench-zoom\n",
+         prog, prog, prog, prog, prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--bench-atlas") == 0) {
+    bench_atlas_conversion();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    return bench_main(argc - 2, argv + 2);
+  if (argc > 1 && strcmp(argv[1], "--bench-scrollback") == 0) {
+    bench_scrollback();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-zoom") == 0) {
+    bench_zoom();
+    return 0;
+  }
+
+  const char *record_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+      record_path = argv[++i];
+    else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+      replay_path = argv[++i];
+    else if (strcmp(argv[i], "--fast") == 0)
+      replay_fast = 1;
+    else if (strcmp(argv[i], "--sdf") == 0)
+      sdf_atlas = 1;
+    else
+      usage(argv[0]);
+  }
+  if ((record_path && replay_path) || (replay_fast && !replay_path))
+    usage(argv[0]);
+
+  show_stats = getenv("OOLONG_STATS") != NULL;
+  if (!replay_path)
+    spawn_shell();
+
+  init_vterm();
 
   SDL_Init(SDL_INIT_VIDEO);
   window =
       SDL_CreateWindow("Term", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
                        800, 600, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
   renderer = SDL_CreateRenderer(
-      window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+      window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
 
   load_font();
+  update_frame_interval();
 
   // Initial Sizing
   int w, h;
   SDL_GetWindowSize(window, &w, &h);
-  int rows = h / cell_height;
-  int cols = w / cell_width;
-  vterm_set_size(vterm, rows, cols);
-  struct winsize ws = {rows, cols, 0, 0};
-  ioctl(master_fd, TIOCSWINSZ, &ws);
+  if (record_path)
+    record_open(record_path);
+  resize_term(h / cell_height, w / cell_width);
+
+  if (replay_path)
+    start_replay();
+  else
+    start_pty_reader();
+  search_init();
 
   int running = 1;
-  char buffer[4096];
 
   while (running) {
+    // Sleep until input, PTY output, the next frame deadline or the next
+    // blink; with none of those pending we block indefinitely
     SDL_Event ev;
-    while (SDL_PollEvent(&ev)) {
+    int timeout = next_wakeup();
+    int have_event = timeout == 0 ? SDL_PollEvent(&ev)
+                                  : SDL_WaitEventTimeout(&ev, timeout);
+    for (; have_event; have_event = SDL_PollEvent(&ev)) {
       if (ev.type == SDL_QUIT)
         running = 0;
+      if (ev.type == pty_event)
+        atomic_store(&pty_ring.wakeup_pending, 0);
+      if (ev.type == search_event) {
+        atomic_store(&search_wakeup_pending, 0);
+        dirty = 1; // New matches to highlight
+      }
 
       if (ev.type == SDL_WINDOWEVENT &&
-          ev.window.event == SDL_WINDOWEVENT_RESIZED) {
-        int w = ev.window.data1;
-        int h = ev.window.data2;
-        int rows = h / cell_height;
-        int cols = w / cell_width;
-        vterm_set_size(vterm, rows, cols);
-        vterm_screen_flush_damage(vterm_screen);
-        struct winsize ws = {rows, cols, 0, 0};
-        ioctl(master_fd, TIOCSWINSZ, &ws);
+          ev.window.event == SDL_WINDOWEVENT_RESIZED)
+        zoom_fit();
+      if (ev.type == SDL_WINDOWEVENT &&
+          (ev.window.event == SDL_WINDOWEVENT_FOCUS_GAINED ||
+           ev.window.event == SDL_WINDOWEVENT_FOCUS_LOST)) {
+        window_focused = ev.window.event == SDL_WINDOWEVENT_FOCUS_GAINED;
+        cursor_reset_blink();
         dirty = 1;
       }
+      if (ev.type == SDL_TEXTINPUT || ev.type == SDL_KEYDOWN)
+        cursor_reset_blink();
+      if (ev.type == SDL_WINDOWEVENT &&
+          ev.window.event == SDL_WINDOWEVENT_MOVED)
+        update_frame_interval(); // May have moved to another display
+      if (ev.type == SDL_RENDER_TARGETS_RESET)
+        shadow_invalidate();
+      if (ev.type == SDL_MOUSEWHEEL)
+        view_scroll(ev.wheel.y * SCROLL_WHEEL_LINES);
       if (ev.type == SDL_TEXTINPUT && !(SDL_GetModState() & KMOD_CTRL)) {
-        write(master_fd, ev.text.text, strlen(ev.text.text));
+        if (search_open)
+          search_type(ev.text.text);
+        else
+          send_input(ev.text.text, strlen(ev.text.text));
       }
       if (ev.type == SDL_KEYDOWN) {
         SDL_Keycode key = ev.key.keysym.sym;
-        if (SDL_GetModState() & KMOD_CTRL) {
+        if (handle_shortcut(key, SDL_GetModState())) {
+          // Consumed by the terminal itself
+        } else if (search_open) {
+          // Keys go to the search bar, never to the shell
+          search_handle_key(key, SDL_GetModState());
+        } else if (SDL_GetModState() & KMOD_CTRL) {
           if (key >= SDLK_a && key <= SDLK_z) {
             char c = key - SDLK_a + 1;
-            write(master_fd, &c, 1);
+            send_input(&c, 1);
           } else if (key == SDLK_c) {
             char c = 3;
-            write(master_fd, &c, 1);
+            send_input(&c, 1);
           } else if (key == SDLK_LEFTBRACKET) {
             char c = 27;
-            write(master_fd, &c, 1);
+            send_input(&c, 1);
           }
         } else {
           const char *seq = NULL;
@@ -326,35 +4154,50 @@ int main() {
             seq = "\x1b[F";
 
           if (seq)
-            write(master_fd, seq, strlen(seq));
+            send_input(seq, strlen(seq));
         }
       }
     }
 
-    fd_set rfd;
-    FD_ZERO(&rfd);
-    FD_SET(master_fd, &rfd);
-    struct timeval tv = {0, dirty ? 0 : 10000};
+    if (atlas_rebuild_finish())
+      zoom_fit();
 
-    if (select(master_fd + 1, &rfd, NULL, NULL, &tv) > 0) {
-      int len = read(master_fd, buffer, sizeof(buffer));
-      if (len > 0) {
-        vterm_input_write(vterm, buffer, len);
-        vterm_screen_flush_damage(vterm_screen);
-        dirty = 1;
-      } else if (len < 0 && errno != EIO)
-        running = 0;
+    if (atomic_load(&replay_rows)) {
+      // Everything before the resize has been parsed; apply it in order
+      int rows = atomic_exchange(&replay_rows, 0);
+      int cols = atomic_load(&replay_cols);
+      resize_term(rows, cols);
+      SDL_SetWindowSize(window, cols * cell_width, rows * cell_height);
+      SDL_SemPost(replay_resized);
+    }
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    pacing_account(pty_drain(), now);
+    paste_feed();
+    pty_flush(); // Input from this iteration and libvterm's replies
+    if (pty_hung_up() && !replay_path) {
+      running = 0;
+    } else if (pty_hung_up() && !replay_done) {
+      double secs = (double)(SDL_GetPerformanceCounter() - replay_started) /
+                    SDL_GetPerformanceFrequency();
+      printf("Replayed %.1f MB in %.3f s (%.1f MB/s)\n", replay_bytes / 1e6,
+             secs, replay_bytes / 1e6 / secs);
+      replay_done = 1;
     }
 
-    if (dirty)
+    now = SDL_GetPerformanceCounter();
+    if (dirty && now >= next_frame) {
       render_term();
-    static int last_blink = 0;
-    if (SDL_GetTicks() / 500 != last_blink) {
-      dirty = 1;
-      last_blink = SDL_GetTicks() / 500;
+      next_frame = now + current_frame_interval();
     }
+    if (cursor_lit(SDL_GetTicks()) != cursor_shown_lit)
+      dirty = 1; // Blink phase changed: re-present, nothing is redrawn
   }
 
+  atlas_rebuild_cancel();
+  atlas_cache_save();
+  if (record_file)
+    fclose(record_file);
   SDL_Quit();
   vterm_free(vterm);
   return 0;